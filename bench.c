@@ -0,0 +1,393 @@
+#define _POSIX_C_SOURCE 200809L
+#include "javelin.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <netinet/in.h>
+#endif
+
+// Microbenchmarks, printed as one JSON object per line so runs can be compared across versions:
+//
+//   bench [name filter] [max connections]
+//
+// Connection counts for the process benchmarks double from 1 up to max connections (4096 by default).
+// Those run over the in-process simulator, so they measure javelin itself rather than the kernel.
+
+static const char* nameFilter = NULL;
+
+static javelin_u32 randomNumber( void )
+{
+	javelin_u32 v1 = rand();
+	javelin_u32 v2 = rand();
+	return (v1 << 16) ^ v2 ^ 1;
+}
+
+static double getSeconds( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool isSelected( const char* name )
+{
+	return nameFilter == NULL || strstr( name, nameFilter ) != NULL;
+}
+
+static void report( const char* name, const javelin_u32 param, const javelin_u64 operations, const double seconds, const javelin_u64 bytes )
+{
+	printf( "{\"name\":\"%s\",\"param\":%u,\"operations\":%llu,\"seconds\":%.6f,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f,\"mb_per_sec\":%.2f}\n",
+		name, param, (unsigned long long)operations, seconds,
+		operations > 0 ? seconds * 1e9 / operations : 0.0,
+		seconds > 0 ? operations / seconds : 0.0,
+		seconds > 0 ? bytes / seconds / 1e6 : 0.0 );
+	fflush( stdout );
+}
+
+// Keeps the optimizer from discarding values that are read but never used
+static volatile javelin_u64 sink;
+
+static void benchSerialize( void )
+{
+	const javelin_u32 iterations = 2000000;
+
+	if ( isSelected( "serialize_bytes" ) ) {
+		javelin_u64 total = 0;
+		javelin_u64 bytes = 0;
+		const double start = getSeconds();
+		for ( javelin_u32 i = 0; i < iterations; i++ ) {
+			struct JavelinMessageBlock block = javelinCreateMessage();
+			javelinWriteU8( &block, (javelin_u8)i );
+			javelinWriteU16( &block, (javelin_u16)i );
+			javelinWriteU32( &block, i );
+			javelinWriteU64( &block, (javelin_u64)i * 3 );
+			javelinWriteS32( &block, -(javelin_s32)i );
+			javelinWriteCharArray( &block, "position", 8 );
+			total += javelinReadU8( &block );
+			total += javelinReadU16( &block );
+			total += javelinReadU32( &block );
+			total += javelinReadU64( &block );
+			total += javelinReadS32( &block );
+			char text[16];
+			javelinReadCharArray( &block, text, sizeof (text) );
+			total += text[0];
+			bytes += block.size;
+		}
+		report( "serialize_bytes", 0, iterations, getSeconds() - start, bytes );
+		sink = total;
+	}
+
+	if ( isSelected( "serialize_bits" ) ) {
+		javelin_u64 total = 0;
+		javelin_u64 bytes = 0;
+		const double start = getSeconds();
+		for ( javelin_u32 i = 0; i < iterations; i++ ) {
+			struct JavelinMessageBlock block = javelinCreateMessage();
+			const float position[3] = { (float)(i & 1023), -3.5f, 200.25f };
+			struct JavelinBitWriter writer = javelinBeginBits( &block );
+			javelinWriteBool( &writer, i & 1 );
+			javelinWriteVarU64( &writer, i );
+			javelinWriteRanged( &writer, i & 63, 0, 63 );
+			javelinWriteQuantizedArray( &writer, position, 3, -1024.0f, 1024.0f, 16 );
+			javelinWriteFloat( &writer, 0.5f );
+			javelinEndBits( &writer );
+			struct JavelinBitReader reader = javelinBeginReadBits( &block );
+			float readPosition[3];
+			total += javelinReadBool( &reader );
+			total += javelinReadVarU64( &reader );
+			total += javelinReadRanged( &reader, 0, 63 );
+			javelinReadQuantizedArray( &reader, readPosition, 3, -1024.0f, 1024.0f, 16 );
+			total += (javelin_u64)readPosition[0];
+			total += (javelin_u64)javelinReadFloat( &reader );
+			total += javelinEndReadBits( &reader );
+			bytes += block.size;
+		}
+		report( "serialize_bits", 0, iterations, getSeconds() - start, bytes );
+		sink = total;
+	}
+}
+
+// A server and clientCount clients connected over a simulator with no latency or loss
+struct BenchNetwork {
+	struct JavelinSimulator simulator;
+	struct JavelinState* server;
+	struct JavelinState* clients;
+	javelin_u32 clientCount;
+	struct JavelinConnection** serverConnections;
+	javelin_u32 connectedCount;
+};
+
+static void drainEvents( struct BenchNetwork* network, struct JavelinState* state, const bool isServer )
+{
+	struct JavelinEvent event;
+	while ( javelinProcess( state, &event ) ) {
+		if ( isServer && event.type == JAVELIN_EVENT_CONNECT ) {
+			network->serverConnections[network->connectedCount++] = event.connection;
+		}
+	}
+}
+
+static void stepClients( struct BenchNetwork* network )
+{
+	for ( javelin_u32 i = 0; i < network->clientCount; i++ ) {
+		drainEvents( network, &network->clients[i], false );
+	}
+}
+
+static bool createNetwork( struct BenchNetwork* network, const javelin_u32 clientCount )
+{
+	memset( network, 0, sizeof (struct BenchNetwork) );
+	if ( javelinCreateSimulator( &network->simulator, clientCount + 1, 1, NULL ) != JAVELIN_ERROR_OK ) {
+		return false;
+	}
+	network->server = (struct JavelinState*)calloc( 1, sizeof (struct JavelinState) );
+	network->clients = (struct JavelinState*)malloc( clientCount * sizeof (struct JavelinState) );
+	network->serverConnections = (struct JavelinConnection**)calloc( clientCount, sizeof (struct JavelinConnection*) );
+	if ( network->server == NULL || network->clients == NULL || network->serverConnections == NULL ) {
+		return false;
+	}
+	const struct JavelinConfig config = javelinCreateConfig();
+	if ( javelinCreateSimulated( network->server, &network->simulator, NULL, 1000, clientCount, randomNumber, &config ) != JAVELIN_ERROR_OK ) {
+		return false;
+	}
+	for ( javelin_u32 i = 0; i < clientCount; i++ ) {
+		if ( javelinCreateSimulated( &network->clients[i], &network->simulator, NULL, 0, 1, randomNumber, &config ) != JAVELIN_ERROR_OK ) {
+			return false;
+		}
+		network->clientCount++;
+		if ( javelinConnect( &network->clients[i], "127.0.0.1", 1000 ) != JAVELIN_ERROR_OK ) {
+			return false;
+		}
+		// Connect in waves, so the server never has more than JAVELIN_MAX_PENDING_CONNECTIONS handshakes at once
+		if ( network->clientCount % JAVELIN_MAX_PENDING_CONNECTIONS != 0 && network->clientCount != clientCount ) {
+			continue;
+		}
+		for ( javelin_u32 tick = 0; tick < 1000 && network->connectedCount < network->clientCount; tick++ ) {
+			javelinAdvanceSimulator( &network->simulator, 1 );
+			drainEvents( network, network->server, true );
+			stepClients( network );
+		}
+		if ( network->connectedCount != network->clientCount ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void destroyNetwork( struct BenchNetwork* network )
+{
+	for ( javelin_u32 i = 0; i < network->clientCount; i++ ) {
+		javelinDestroy( &network->clients[i] );
+	}
+	if ( network->server != NULL && network->server->simulator != NULL ) {
+		javelinDestroy( network->server );
+	}
+	javelinDestroySimulator( &network->simulator );
+	free( network->server );
+	free( network->clients );
+	free( network->serverConnections );
+}
+
+// Lets the client acknowledge everything the server has sent, so its message rings are empty again
+static void settleNetwork( struct BenchNetwork* network )
+{
+	for ( javelin_u32 tick = 0; tick < 50; tick++ ) {
+		javelinAdvanceSimulator( &network->simulator, JAVELIN_ACK_DELAY_MS );
+		drainEvents( network, network->server, true );
+		stepClients( network );
+	}
+}
+
+static void benchQueue( void )
+{
+	if ( !isSelected( "queue_message" ) && !isSelected( "begin_commit" ) ) {
+		return;
+	}
+	struct BenchNetwork network;
+	if ( !createNetwork( &network, 1 ) ) {
+		printf( "Error creating simulated network\n" );
+		destroyNetwork( &network );
+		return;
+	}
+	struct JavelinConnection* connection = network.serverConnections[0];
+	const javelin_u32 batch = 1024;
+	const javelin_u32 rounds = 200;
+
+	if ( isSelected( "queue_message" ) ) {
+		double seconds = 0;
+		for ( javelin_u32 round = 0; round < rounds; round++ ) {
+			const double start = getSeconds();
+			for ( javelin_u32 i = 0; i < batch; i++ ) {
+				struct JavelinMessageBlock block = javelinCreateMessage();
+				javelinWriteU32( &block, i );
+				javelinWriteU64( &block, round );
+				javelinQueueMessage( connection, &block );
+			}
+			seconds += getSeconds() - start;
+			settleNetwork( &network );
+		}
+		report( "queue_message", 12, (javelin_u64)batch * rounds, seconds, (javelin_u64)batch * rounds * 12 );
+	}
+
+	if ( isSelected( "begin_commit" ) ) {
+		double seconds = 0;
+		for ( javelin_u32 round = 0; round < rounds; round++ ) {
+			const double start = getSeconds();
+			for ( javelin_u32 i = 0; i < batch; i++ ) {
+				struct JavelinMessageBlock* block;
+				if ( javelinBeginMessage( connection, 0, &block ) != JAVELIN_ERROR_OK ) {
+					break;
+				}
+				javelinWriteU32( block, i );
+				javelinWriteU64( block, round );
+				javelinCommitMessage( connection, block );
+			}
+			seconds += getSeconds() - start;
+			settleNetwork( &network );
+		}
+		report( "begin_commit", 12, (javelin_u64)batch * rounds, seconds, (javelin_u64)batch * rounds * 12 );
+	}
+
+	destroyNetwork( &network );
+}
+
+// Time spent in the server's javelinProcess loop per 16 ms tick. Idle connections only exchange pings and acks,
+// busy ones also get a broadcast from the server and send the server a message every tick.
+static void benchProcess( const javelin_u32 maxConnections )
+{
+	const bool idle = isSelected( "process_idle" );
+	const bool busy = isSelected( "process_busy" );
+	if ( !idle && !busy ) {
+		return;
+	}
+	for ( javelin_u32 connections = 1; connections <= maxConnections; connections *= 2 ) {
+		struct BenchNetwork network;
+		if ( !createNetwork( &network, connections ) ) {
+			printf( "Error creating simulated network with %u connections\n", connections );
+			destroyNetwork( &network );
+			return;
+		}
+		const javelin_u32 ticks = 200;
+
+		for ( int pass = 0; pass < 2; pass++ ) {
+			const bool isBusy = pass == 1;
+			if ( isBusy ? !busy : !idle ) {
+				continue;
+			}
+			double seconds = 0;
+			for ( javelin_u32 tick = 0; tick < ticks; tick++ ) {
+				javelinAdvanceSimulator( &network.simulator, 16 );
+				if ( isBusy ) {
+					struct JavelinMessageBlock block = javelinCreateMessage();
+					javelinWriteU32( &block, tick );
+					javelinWriteU64( &block, connections );
+					javelinBroadcastMessage( network.server, &block );
+					for ( javelin_u32 i = 0; i < network.clientCount; i++ ) {
+						javelinQueueMessage( &network.clients[i].connectionSlots[0], &block );
+					}
+				}
+				const double start = getSeconds();
+				drainEvents( &network, network.server, true );
+				seconds += getSeconds() - start;
+				stepClients( &network );
+			}
+			report( isBusy ? "process_busy" : "process_idle", connections, ticks, seconds, 0 );
+		}
+		destroyNetwork( &network );
+	}
+}
+
+// Reliable messages from a client to a server over real loopback sockets, so every message is written into a
+// packet, sent, received and parsed
+static void benchLoopback( void )
+{
+	if ( !isSelected( "loopback" ) ) {
+		return;
+	}
+	struct JavelinState* server = (struct JavelinState*)malloc( sizeof (struct JavelinState) );
+	struct JavelinState* client = (struct JavelinState*)malloc( sizeof (struct JavelinState) );
+	if ( server == NULL || client == NULL || javelinCreate( server, "127.0.0.1", 0, 1, randomNumber ) != JAVELIN_ERROR_OK ) {
+		printf( "Error initializing javelin\n" );
+		free( client );
+		free( server );
+		return;
+	}
+	if ( javelinCreate( client, "127.0.0.1", 0, 1, randomNumber ) != JAVELIN_ERROR_OK ) {
+		printf( "Error initializing javelin\n" );
+		javelinDestroy( server );
+		free( client );
+		free( server );
+		return;
+	}
+	struct sockaddr_storage serverAddress;
+	socklen_t addressLength = sizeof (serverAddress);
+	getsockname( javelinGetSocket( server ), (struct sockaddr*)&serverAddress, &addressLength );
+	const javelin_u16 port = ntohs( ((struct sockaddr_in*)&serverAddress)->sin_port );
+	if ( javelinConnect( client, "127.0.0.1", port ) != JAVELIN_ERROR_OK ) {
+		printf( "Error connecting to server\n" );
+		javelinDestroy( client );
+		javelinDestroy( server );
+		free( client );
+		free( server );
+		return;
+	}
+
+	const javelin_u32 messageCount = 1000000;
+	const javelin_u32 messageSize = 32;
+	javelin_u32 sent = 0;
+	javelin_u32 received = 0;
+	bool connected = false;
+	double start = 0;
+	for ( javelin_u32 idle = 0; received < messageCount && idle < 100000; idle++ ) {
+		struct JavelinEvent event;
+		while ( javelinProcess( server, &event ) ) {
+			if ( event.type == JAVELIN_EVENT_DATA ) {
+				sink = javelinReadU32( event.message );
+				received++;
+				idle = 0;
+			}
+		}
+		while ( javelinProcess( client, &event ) ) {
+			if ( event.type == JAVELIN_EVENT_CONNECT ) {
+				connected = true;
+				start = getSeconds();
+			}
+		}
+		while ( connected && sent < messageCount ) {
+			struct JavelinMessageBlock block = javelinCreateMessage();
+			javelinWriteU32( &block, sent );
+			block.size = messageSize;
+			if ( javelinQueueMessage( &client->connectionSlots[0], &block ) != JAVELIN_ERROR_OK ) {
+				break;
+			}
+			sent++;
+		}
+		javelinWait( client, 1 );
+	}
+	const double seconds = getSeconds() - start;
+	const struct JavelinConnection* connection = &client->connectionSlots[0];
+	report( "loopback_messages", messageSize, received, seconds, (javelin_u64)received * messageSize );
+	report( "loopback_packets", messageSize, connection->packetsSent, seconds, connection->bytesSent );
+
+	javelinDestroy( client );
+	javelinDestroy( server );
+	free( client );
+	free( server );
+}
+
+int main( int argc, char** argv )
+{
+	if ( argc > 1 && strcmp( argv[1], "all" ) != 0 ) {
+		nameFilter = argv[1];
+	}
+	const javelin_u32 maxConnections = argc > 2 ? (javelin_u32)atoi( argv[2] ) : 4096;
+	srand( 1 );
+
+	benchSerialize();
+	benchQueue();
+	benchProcess( maxConnections );
+	benchLoopback();
+	return 0;
+}
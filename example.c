@@ -71,14 +71,10 @@ int main()
 			if ( position[s] > 120 ) {
 				position[s] -= 120;
 			}
-			for ( int slot = 0; slot < netState.connectionLimit; slot++ ) {
-				if ( netState.connectionSlots[slot].isActive ) {
-					struct JavelinMessageBlock block = {0};
-					javelinWriteU16( &block, s );
-					javelinWriteU32( &block, position[s] );
-					javelinQueueMessage( &netState.connectionSlots[slot], &block );
-				}
-			}
+			struct JavelinMessageBlock block = {0};
+			javelinWriteU16( &block, s );
+			javelinWriteU32( &block, position[s] );
+			javelinBroadcastMessage( &netState, &block );
 		}
 #endif
 		for ( int i = 0; i < 5; i++ ) {
@@ -1,9 +1,14 @@
 #define _POSIX_C_SOURCE 200809L
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	// recvmmsg, sendmmsg
+#endif
 
 #include "javelin.h"
 #include <assert.h>
 #include <errno.h>
+#include <stdatomic.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -12,25 +17,138 @@
 #include <winsock2.h>
 #else
 #include <netdb.h>
+#include <poll.h>
 #include <sys/types.h>
+#if JAVELIN_IO_THREAD
+#include <pthread.h>
+#endif
 #endif
 
 #ifndef VERBOSE
 #define VERBOSE 0
 #endif
 
+// Message ids are 16 bits, so this never matches a stored message
+#define INVALID_MESSAGE_ID 0xffffffffu
+
+// type, salt, latest channel, latest id, ack channel mask, then an ack id and ack bits for each channel in the mask
+#define PACKET_HEADER_SIZE (sizeof (javelin_u8) + sizeof (javelin_u32) + sizeof (javelin_u8) + sizeof (javelin_u16) + sizeof (javelin_u8))
+#define PACKET_ACK_SIZE (sizeof (javelin_u16) + sizeof (javelin_u32))
+
+// Each message in a DATA packet starts with its id (or sequence number) and a size field, whose top bits say how it is delivered
+#define MESSAGE_KIND_SHIFT 14
+#define MESSAGE_CHANNEL_SHIFT 11
+#define MESSAGE_CHANNEL_MASK 7
+#define MESSAGE_SIZE_MASK ((1 << MESSAGE_CHANNEL_SHIFT) - 1)
+enum JavelinMessageKind {
+	MESSAGE_KIND_RELIABLE,
+	MESSAGE_KIND_UNRELIABLE,
+	MESSAGE_KIND_SEQUENCED,	// unreliable, with stale arrivals dropped
+	MESSAGE_KIND_FRAGMENT,	// reliable, one piece of a large message
+};
+
+// Fragments start with their index and the number of fragments in the large message, counted in the size field
+#define FRAGMENT_HEADER_SIZE (sizeof (javelin_u16) + sizeof (javelin_u16))
+
+// While javelinStartThread() runs a state on its own thread, calls from the game thread are passed to it as
+// commands, and events are passed back. These are defined with the thread at the end of the file.
+enum JavelinThreadCommandType {
+	THREAD_COMMAND_MESSAGE,
+	THREAD_COMMAND_UNRELIABLE,
+	THREAD_COMMAND_SEQUENCED,
+	THREAD_COMMAND_BROADCAST,
+	THREAD_COMMAND_BROADCAST_TO,
+	THREAD_COMMAND_LARGE,
+	THREAD_COMMAND_FLUSH,
+	THREAD_COMMAND_DISCONNECT,
+};
+static enum JavelinError pushThreadCommand( struct JavelinState* state, const enum JavelinThreadCommandType type, struct JavelinConnection* connection, const struct JavelinMessageBlock* block, const javelin_u32 channelIndex, const void* data, const size_t size );
+static enum JavelinError beginThreadMessage( struct JavelinConnection* connection, const javelin_u32 channelIndex, struct JavelinMessageBlock** outBlock );
+static enum JavelinError commitThreadMessage( struct JavelinConnection* connection, struct JavelinMessageBlock* block );
+static size_t pollThreadEvents( struct JavelinState* state, struct JavelinEvent* events, const size_t maxEvents );
+static bool waitForThreadEvents( struct JavelinState* state, const javelin_u32 maxWaitMs );
+static void notifyIoThread( struct JavelinState* state );
+
+// Messages queued from other threads are moved into their connection's ring by javelinUpdate()
+static enum JavelinError queueMessage( struct JavelinConnection* connection, const struct JavelinMessageBlock* block );
+
+// A message queued by javelinQueueMessageConcurrent(), for the connection with this generation
+struct JavelinConcurrentMessage {
+	struct JavelinConcurrentMessage* next;
+	javelin_u16 generation;
+	struct JavelinMessageBlock block;
+};
+
+// Each connection's concurrent messages are pushed onto a lock-free stack, which is taken all at once and reversed
+struct JavelinConcurrentQueue {
+	_Atomic(struct JavelinConcurrentMessage*) head;	// newest first
+	atomic_uint count;	// waiting to be queued, limited to config.maxMessages
+	struct JavelinConcurrentMessage* held;	// taken but waiting for room in the message ring, oldest first
+	struct JavelinConcurrentMessage* heldTail;
+};
+
+// The parts of a state that other threads may touch, which live as long as the state
+struct JavelinSharedState {
+	atomic_bool ioThreadSleeping;	// set while the I/O thread waits, so new work has to wake it
+#ifdef _WIN32
+	struct sockaddr_storage wakeAddress;
+#else
+	int wakePipe[2];	// the I/O thread waits on the read end alongside the socket, zero until first needed
+#endif
+	atomic_bool concurrentPending;	// set when a concurrent message is pushed, so updates only look when there are some
+	bool concurrentHeld;	// some queue has held messages, only touched by the thread running the state
+	struct JavelinConcurrentQueue queues[];	// one for each connection slot
+};
+
+// Everything is sent little-endian, so on little-endian hosts whole words are copied in one go
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define LITTLE_ENDIAN_HOST 1
+#else
+#define LITTLE_ENDIAN_HOST 0
+#endif
+
+// Stores the low byteCount bytes of value, up to eight
+static void storeWord( javelin_u8* buffer, const javelin_u64 value, const size_t byteCount )
+{
+#if LITTLE_ENDIAN_HOST
+	memcpy( buffer, &value, byteCount );
+#else
+	for ( size_t i = 0; i < byteCount; i++ ) {
+		buffer[i] = (javelin_u8)(value >> (i * 8));
+	}
+#endif
+}
+
+static javelin_u64 loadWord( const javelin_u8* buffer, const size_t byteCount )
+{
+	javelin_u64 value = 0;
+#if LITTLE_ENDIAN_HOST
+	memcpy( &value, buffer, byteCount );
+#else
+	for ( size_t i = 0; i < byteCount; i++ ) {
+		value |= (javelin_u64)buffer[i] << (i * 8);
+	}
+#endif
+	return value;
+}
+
+static size_t messageCapacity( const struct JavelinMessageBlock* block )
+{
+	return block->capacity > 0 ? block->capacity : JAVELIN_MAX_MESSAGE_SIZE;
+}
+
 enum JavelinError javelinWriteCharArray( struct JavelinMessageBlock* block, const char* buffer, const size_t length )
 {
 	if ( length >= (1 << 16) ) {
 		return JAVELIN_ERROR_CHAR_ARRAY_TOO_LONG;
 	}
 
-	if ( block->size + sizeof (javelin_u16) + length > JAVELIN_MAX_MESSAGE_SIZE ) {
+	if ( block->size + sizeof (javelin_u16) + length > messageCapacity( block ) ) {
 		return JAVELIN_ERROR_MESSAGE_FULL;
 	}
 	javelinWriteU16( block, (javelin_u16)length );
 	memcpy( &block->payload[block->size], buffer, length );
-	block->size += sizeof (javelin_u16) + length;
+	block->size += length;
 	return JAVELIN_ERROR_OK;
 }
 
@@ -41,7 +159,7 @@ static void writeBufferU8( javelin_u8* buffer, size_t* offset, const javelin_u8
 
 enum JavelinError javelinWriteU8( struct JavelinMessageBlock* block, const javelin_u8 value )
 {
-	if ( block->size + sizeof (javelin_u8) > JAVELIN_MAX_MESSAGE_SIZE ) {
+	if ( block->size + sizeof (javelin_u8) > messageCapacity( block ) ) {
 		return JAVELIN_ERROR_MESSAGE_FULL;
 	}
 	writeBufferU8( block->payload, &block->size, value );
@@ -50,13 +168,13 @@ enum JavelinError javelinWriteU8( struct JavelinMessageBlock* block, const javel
 
 static void writeBufferU16( javelin_u8* buffer, size_t* offset, const javelin_u16 value )
 {
-	buffer[(*offset)++] = value & 0xff;
-	buffer[(*offset)++] = (value >> 8) & 0xff;
+	storeWord( &buffer[*offset], value, sizeof (javelin_u16) );
+	*offset += sizeof (javelin_u16);
 }
 
 enum JavelinError javelinWriteU16( struct JavelinMessageBlock* block, const javelin_u16 value )
 {
-	if ( block->size + sizeof (javelin_u16) > JAVELIN_MAX_MESSAGE_SIZE ) {
+	if ( block->size + sizeof (javelin_u16) > messageCapacity( block ) ) {
 		return JAVELIN_ERROR_MESSAGE_FULL;
 	}
 	writeBufferU16( block->payload, &block->size, value );
@@ -70,15 +188,13 @@ enum JavelinError javelinWriteS16( struct JavelinMessageBlock* block, const jave
 
 static void writeBufferU32( javelin_u8* buffer, size_t* offset, const javelin_u32 value )
 {
-	buffer[(*offset)++] = value & 0xff;
-	buffer[(*offset)++] = (value >> 8) & 0xff;
-	buffer[(*offset)++] = (value >> 16) & 0xff;
-	buffer[(*offset)++] = (value >> 24) & 0xff;
+	storeWord( &buffer[*offset], value, sizeof (javelin_u32) );
+	*offset += sizeof (javelin_u32);
 }
 
 enum JavelinError javelinWriteU32( struct JavelinMessageBlock* block, const javelin_u32 value )
 {
-	if ( block->size + sizeof (javelin_u32) > JAVELIN_MAX_MESSAGE_SIZE ) {
+	if ( block->size + sizeof (javelin_u32) > messageCapacity( block ) ) {
 		return JAVELIN_ERROR_MESSAGE_FULL;
 	}
 	writeBufferU32( block->payload, &block->size, value );
@@ -92,19 +208,13 @@ enum JavelinError javelinWriteS32( struct JavelinMessageBlock* block, const jave
 
 static void writeBufferU64( javelin_u8* buffer, size_t* offset, const javelin_u64 value )
 {
-	buffer[(*offset)++] = value & 0xff;
-	buffer[(*offset)++] = (value >> 8) & 0xff;
-	buffer[(*offset)++] = (value >> 16) & 0xff;
-	buffer[(*offset)++] = (value >> 24) & 0xff;
-	buffer[(*offset)++] = (value >> 32) & 0xff;
-	buffer[(*offset)++] = (value >> 40) & 0xff;
-	buffer[(*offset)++] = (value >> 48) & 0xff;
-	buffer[(*offset)++] = (value >> 56) & 0xff;
+	storeWord( &buffer[*offset], value, sizeof (javelin_u64) );
+	*offset += sizeof (javelin_u64);
 }
 
 enum JavelinError javelinWriteU64( struct JavelinMessageBlock* block, const javelin_u64 value )
 {
-	if ( block->size + sizeof (javelin_u64) > JAVELIN_MAX_MESSAGE_SIZE ) {
+	if ( block->size + sizeof (javelin_u64) > messageCapacity( block ) ) {
 		return JAVELIN_ERROR_MESSAGE_FULL;
 	}
 	writeBufferU64( block->payload, &block->size, value );
@@ -117,6 +227,11 @@ enum JavelinError javelinWriteS64( struct JavelinMessageBlock* block, const jave
 }
 
 
+const javelin_u8* javelinGetMessageData( const struct JavelinMessageBlock* block )
+{
+	return block->incomingData != NULL ? block->incomingData : block->payload;
+}
+
 size_t javelinReadCharArray( struct JavelinMessageBlock* block, char* buffer, const size_t bufferSize )
 {
 	if ( block->incomingReadOffset > block->size ) {
@@ -126,9 +241,9 @@ size_t javelinReadCharArray( struct JavelinMessageBlock* block, char* buffer, co
 	if ( block->incomingReadOffset + length > block->size ) {
 		return 0;
 	}
-	const size_t copyCount = length < bufferSize ? bufferSize : length;
-	memcpy( buffer, &block->payload[block->incomingReadOffset], copyCount );
-	block->incomingReadOffset += copyCount;
+	const size_t copyCount = length < bufferSize ? length : bufferSize;
+	memcpy( buffer, &javelinGetMessageData( block )[block->incomingReadOffset], copyCount );
+	block->incomingReadOffset += length;
 	return length;
 }
 
@@ -143,14 +258,14 @@ javelin_u8 javelinReadU8( struct JavelinMessageBlock* block )
 	if ( block->incomingReadOffset + sizeof (javelin_u8) > block->size ) {
 		return 0;
 	}
-	return readBufferU8( block->payload, &block->incomingReadOffset );
+	return readBufferU8( javelinGetMessageData( block ), &block->incomingReadOffset );
 }
 
 static javelin_u16 readBufferU16( const javelin_u8* buffer, size_t* offset )
 {
-	const javelin_u8 v1 = buffer[(*offset)++];
-	const javelin_u8 v2 = buffer[(*offset)++];
-	return ((javelin_u16)v1) | ((javelin_u16)v2 << 8);
+	const javelin_u16 value = (javelin_u16)loadWord( &buffer[*offset], sizeof (javelin_u16) );
+	*offset += sizeof (javelin_u16);
+	return value;
 }
 
 javelin_u16 javelinReadU16( struct JavelinMessageBlock* block )
@@ -158,7 +273,7 @@ javelin_u16 javelinReadU16( struct JavelinMessageBlock* block )
 	if ( block->incomingReadOffset + sizeof (javelin_u16) > block->size ) {
 		return 0;
 	}
-	return readBufferU16( block->payload, &block->incomingReadOffset );
+	return readBufferU16( javelinGetMessageData( block ), &block->incomingReadOffset );
 }
 
 javelin_s16 javelinReadS16( struct JavelinMessageBlock* block )
@@ -172,11 +287,9 @@ javelin_s16 javelinReadS16( struct JavelinMessageBlock* block )
 
 static javelin_u32 readBufferU32( const javelin_u8* buffer, size_t* offset )
 {
-	const javelin_u8 v1 = buffer[(*offset)++];
-	const javelin_u8 v2 = buffer[(*offset)++];
-	const javelin_u8 v3 = buffer[(*offset)++];
-	const javelin_u8 v4 = buffer[(*offset)++];
-	return ((javelin_u32)v1) | ((javelin_u32)v2 << 8) | ((javelin_u32)v3 << 16) | ((javelin_u32)v4 << 24);
+	const javelin_u32 value = (javelin_u32)loadWord( &buffer[*offset], sizeof (javelin_u32) );
+	*offset += sizeof (javelin_u32);
+	return value;
 }
 
 javelin_u32 javelinReadU32( struct JavelinMessageBlock* block )
@@ -184,7 +297,7 @@ javelin_u32 javelinReadU32( struct JavelinMessageBlock* block )
 	if ( block->incomingReadOffset + sizeof (javelin_u32) > block->size ) {
 		return 0;
 	}
-	return readBufferU32( block->payload, &block->incomingReadOffset );
+	return readBufferU32( javelinGetMessageData( block ), &block->incomingReadOffset );
 }
 
 javelin_s32 javelinReadS32( struct JavelinMessageBlock* block )
@@ -198,15 +311,9 @@ javelin_s32 javelinReadS32( struct JavelinMessageBlock* block )
 
 static javelin_u64 readBufferU64( const javelin_u8* buffer, size_t* offset )
 {
-	const javelin_u8 v1 = buffer[(*offset)++];
-	const javelin_u8 v2 = buffer[(*offset)++];
-	const javelin_u8 v3 = buffer[(*offset)++];
-	const javelin_u8 v4 = buffer[(*offset)++];
-	const javelin_u8 v5 = buffer[(*offset)++];
-	const javelin_u8 v6 = buffer[(*offset)++];
-	const javelin_u8 v7 = buffer[(*offset)++];
-	const javelin_u8 v8 = buffer[(*offset)++];
-	return ((javelin_u64)v1) | ((javelin_u64)v2 << 8) | ((javelin_u64)v3 << 16) | ((javelin_u64)v4 << 24) | ((javelin_u64)v5 << 32) | ((javelin_u64)v6 << 40) | ((javelin_u64)v7 << 48) | ((javelin_u64)v8 << 56);
+	const javelin_u64 value = loadWord( &buffer[*offset], sizeof (javelin_u64) );
+	*offset += sizeof (javelin_u64);
+	return value;
 }
 
 javelin_u64 javelinReadU64( struct JavelinMessageBlock* block )
@@ -214,7 +321,7 @@ javelin_u64 javelinReadU64( struct JavelinMessageBlock* block )
 	if ( block->incomingReadOffset + sizeof (javelin_u64) > block->size ) {
 		return 0;
 	}
-	return readBufferU64( block->payload, &block->incomingReadOffset );
+	return readBufferU64( javelinGetMessageData( block ), &block->incomingReadOffset );
 }
 
 javelin_s64 javelinReadS64( struct JavelinMessageBlock* block )
@@ -226,224 +333,295 @@ javelin_s64 javelinReadS64( struct JavelinMessageBlock* block )
 	return -(javelin_s64)(-value);
 }
 
-static javelin_u64 getCurrentTime( void )
+static javelin_u32 bitsRequired( javelin_u64 value )
 {
-	struct timespec ts;
-	timespec_get( &ts, TIME_UTC );
-	return ((javelin_u64)ts.tv_sec * 1000 + (ts.tv_nsec / 1000000));
+	javelin_u32 bits = 0;
+	while ( value != 0 ) {
+		bits++;
+		value >>= 1;
+	}
+	return bits;
 }
 
-enum JavelinError javelinCreate( struct JavelinState* state, const char* address, const javelin_u16 port, const javelin_u32 maxConnections, javelin_u32 (*randomGenerator)( void ) )
+static javelin_u64 lowBitMask( const javelin_u32 bitCount )
 {
-	static_assert( JAVELIN_MAX_PACKET_SIZE > sizeof (struct JavelinPacketHeader) + sizeof (javelin_u16) + sizeof (javelin_u16) + JAVELIN_MAX_MESSAGE_SIZE, "Max message size is too large to fit in a packet" );
-	static_assert( (JAVELIN_MAX_MESSAGES & (JAVELIN_MAX_MESSAGES - 1)) == 0, "Max number of messages must be a power of two" );
+	return bitCount >= 64 ? UINT64_MAX : ((javelin_u64)1 << bitCount) - 1;
+}
 
-	if ( randomGenerator == NULL ) {
-		return JAVELIN_ERROR_RANDOM_GENERATOR_REQUIRED;
-	}
-	memset( state, 0, sizeof (struct JavelinState) );
+struct JavelinBitWriter javelinBeginBits( struct JavelinMessageBlock* block )
+{
+	return (struct JavelinBitWriter) { .block = block };
+}
 
-#ifdef _WIN32
-	WSADATA wsaData;
-	int wsaResult = WSAStartup( MAKEWORD(1,1), &wsaData );
-	if ( wsaResult != 0 ) {
-		return JAVELIN_ERROR_WINSOCK;
-	}
-	if ( LOBYTE(wsaData.wVersion) != 1 || HIBYTE(wsaData.wVersion) != 1 ) {
-		WSACleanup();
-		return JAVELIN_ERROR_WINSOCK;
-	}
-#endif
+static bool hasRoomForBits( const struct JavelinBitWriter* writer, const javelin_u64 bitCount )
+{
+	return (javelin_u64)writer->block->size * 8 + writer->scratchBits + bitCount <= (javelin_u64)messageCapacity( writer->block ) * 8;
+}
 
-	struct addrinfo hints = {0};
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_DGRAM;
-	if ( address == NULL ) {
-		hints.ai_flags = AI_PASSIVE;
+// Adds up to 32 bits to the scratch word, storing it to the block 32 bits at a time. Room must already have been checked.
+static void putBits( struct JavelinBitWriter* writer, const javelin_u64 value, const javelin_u32 bitCount )
+{
+	writer->scratch |= (value & lowBitMask( bitCount )) << writer->scratchBits;
+	writer->scratchBits += bitCount;
+	if ( writer->scratchBits >= 32 ) {
+		struct JavelinMessageBlock* block = writer->block;
+		storeWord( &block->payload[block->size], writer->scratch, sizeof (javelin_u32) );
+		block->size += sizeof (javelin_u32);
+		writer->scratch >>= 32;
+		writer->scratchBits -= 32;
 	}
+}
 
-	char portString[10];
-	snprintf( portString, sizeof (portString), "%i", port );
+// Stores the bits left in the scratch word, padding the last byte with zeroes
+void javelinEndBits( struct JavelinBitWriter* writer )
+{
+	struct JavelinMessageBlock* block = writer->block;
+	const size_t byteCount = (writer->scratchBits + 7) / 8;
+	storeWord( &block->payload[block->size], writer->scratch, byteCount );
+	block->size += byteCount;
+	writer->scratch = 0;
+	writer->scratchBits = 0;
+}
 
-	struct addrinfo* addrResults;
-	int aiStatus = getaddrinfo( address, portString, &hints, &addrResults );
-	if ( aiStatus != 0 ) {
-		return JAVELIN_ERROR_GETADDRINFO;
+enum JavelinError javelinWriteBits( struct JavelinBitWriter* writer, const javelin_u32 value, const javelin_u32 bitCount )
+{
+	if ( bitCount > 32 ) {
+		return JAVELIN_ERROR_INVALID_MESSAGE;
 	}
+	if ( !hasRoomForBits( writer, bitCount ) ) {
+		return JAVELIN_ERROR_MESSAGE_FULL;
+	}
+	putBits( writer, value, bitCount );
+	return JAVELIN_ERROR_OK;
+}
 
-	struct addrinfo* addr;
-	for ( addr = addrResults; addr != NULL; addr = addr->ai_next ) {
-		state->socket = socket( addr->ai_family, addr->ai_socktype, addr->ai_protocol );
-		if ( state->socket == -1 ) {
-			continue;
-		}
-
-		int bindResult = bind( state->socket, addr->ai_addr, addr->ai_addrlen );
-		if ( bindResult == -1 ) {
-			// TODO: close socket cross-platform
-			continue;
-		}
-
-		if ( addr->ai_family == AF_INET ) {
-			memcpy( &state->address, addr->ai_addr, sizeof (struct sockaddr_in) );
-		}
-		else {
-			memcpy( &state->address, addr->ai_addr, sizeof (struct sockaddr_in6) );
-
-			int v6Only = 0;
-			setsockopt( state->socket, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof (v6Only) );
-		}
+enum JavelinError javelinWriteBool( struct JavelinBitWriter* writer, const bool value )
+{
+	return javelinWriteBits( writer, value ? 1 : 0, 1 );
+}
 
-#ifdef _WIN32
-		DWORD nonBlocking = 1;
-		int nbResult = ioctlsocket( state->socket, FIONBIO, &nonBlocking );
-		if ( nbResult != 0 ) {
-			return JAVELIN_ERROR_WINSOCK;
-		}
-#else
-		fcntl( state->socket, F_SETFL, O_NONBLOCK );
-#endif
-		break;
+// Seven bits at a time, lowest first, each group with a continuation bit above it
+enum JavelinError javelinWriteVarU64( struct JavelinBitWriter* writer, const javelin_u64 value )
+{
+	const javelin_u32 bits = bitsRequired( value );
+	const javelin_u32 groupCount = bits > 0 ? (bits + 6) / 7 : 1;
+	if ( !hasRoomForBits( writer, groupCount * 8 ) ) {
+		return JAVELIN_ERROR_MESSAGE_FULL;
 	}
-
-	if ( addr == NULL ) {
-		return JAVELIN_ERROR_SOCKET;
+	javelin_u64 remaining = value;
+	for ( javelin_u32 i = 1; i < groupCount; i++ ) {
+		putBits( writer, (remaining & 0x7f) | 0x80, 8 );
+		remaining >>= 7;
 	}
+	putBits( writer, remaining, 8 );
+	return JAVELIN_ERROR_OK;
+}
 
-	freeaddrinfo( addrResults );
+// Zigzag encoded, so values near zero stay short whatever their sign
+enum JavelinError javelinWriteVarS64( struct JavelinBitWriter* writer, const javelin_s64 value )
+{
+	return javelinWriteVarU64( writer, ((javelin_u64)value << 1) ^ (value < 0 ? UINT64_MAX : 0) );
+}
 
-	state->connectionLimit = maxConnections > 0 ? maxConnections : 1;
-	state->connectionSlots = (struct JavelinConnection*)malloc( sizeof (struct JavelinConnection) * state->connectionLimit );
-	if ( state->connectionSlots == 0 ) {
-		return JAVELIN_ERROR_MEMORY;
+// Uses only as many bits as max - min needs, values outside the range are clamped to it
+enum JavelinError javelinWriteRanged( struct JavelinBitWriter* writer, const javelin_s32 value, const javelin_s32 min, const javelin_s32 max )
+{
+	if ( max < min ) {
+		return JAVELIN_ERROR_INVALID_MESSAGE;
 	}
-	memset( state->connectionSlots, 0, sizeof (struct JavelinConnection) * state->connectionLimit );
-	state->randomGenerator = randomGenerator;
+	const javelin_u32 bits = bitsRequired( (javelin_u64)((javelin_s64)max - min) );
+	const javelin_s32 clamped = value < min ? min : (value > max ? max : value);
+	return javelinWriteBits( writer, (javelin_u32)((javelin_s64)clamped - min), bits );
+}
 
-	return JAVELIN_ERROR_OK;
+enum JavelinError javelinWriteFloat( struct JavelinBitWriter* writer, const float value )
+{
+	javelin_u32 bits;
+	memcpy( &bits, &value, sizeof (bits) );
+	return javelinWriteBits( writer, bits, 32 );
 }
 
-void javelinDestroy( struct JavelinState* state )
+static javelin_u32 quantize( const float value, const float min, const float max, const javelin_u32 bitCount )
 {
-	if ( state->socket != 0 ) {
-#ifdef _WIN32
-		closesocket( state->socket );
-#else
-		close( state->socket );
-#endif
+	const double steps = (double)lowBitMask( bitCount );
+	if ( !(value > min) ) {
+		return 0;	// also catches NaN
 	}
-	state->socket = 0;
+	if ( value >= max ) {
+		return (javelin_u32)steps;
+	}
+	return (javelin_u32)(((double)value - min) / ((double)max - min) * steps + 0.5);
+}
 
-	free( state->connectionSlots );
+static float dequantize( const javelin_u32 value, const float min, const float max, const javelin_u32 bitCount )
+{
+	return (float)(min + ((double)max - min) * value / (double)lowBitMask( bitCount ));
+}
 
-#ifdef _WIN32
-	WSACleanup();
-#endif
+// Maps value onto 2^bitCount evenly spaced steps from min to max, clamping anything outside the range
+enum JavelinError javelinWriteQuantized( struct JavelinBitWriter* writer, const float value, const float min, const float max, const javelin_u32 bitCount )
+{
+	return javelinWriteQuantizedArray( writer, &value, 1, min, max, bitCount );
 }
 
-static bool isSaltGood( struct JavelinConnection* connection, javelin_u32 salt )
+// For vectors and other groups of values sharing a range, either all of them are written or none
+enum JavelinError javelinWriteQuantizedArray( struct JavelinBitWriter* writer, const float* values, const size_t count, const float min, const float max, const javelin_u32 bitCount )
 {
-	return connection->remoteSalt != 0 && (salt ^ connection->localSalt) == connection->remoteSalt;
+	if ( bitCount == 0 || bitCount > 32 || !(max > min) ) {
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+	if ( !hasRoomForBits( writer, (javelin_u64)count * bitCount ) ) {
+		return JAVELIN_ERROR_MESSAGE_FULL;
+	}
+	for ( size_t i = 0; i < count; i++ ) {
+		putBits( writer, quantize( values[i], min, max, bitCount ), bitCount );
+	}
+	return JAVELIN_ERROR_OK;
 }
 
-static javelin_u32 calculateSalt( struct JavelinConnection* connection )
+struct JavelinBitReader javelinBeginReadBits( struct JavelinMessageBlock* block )
 {
-	return connection->localSalt ^ connection->remoteSalt;
+	return (struct JavelinBitReader) {
+		.block = block,
+		.readOffset = block->incomingReadOffset < block->size ? block->incomingReadOffset : block->size,
+	};
 }
 
-static void writePacketHeader( struct JavelinState* state, enum JavelinPacketType type, javelin_u32 ackId, javelin_u32 salt )
+// Moves the message's read offset past the last byte the reader used, returning false if any read overflowed
+bool javelinEndReadBits( struct JavelinBitReader* reader )
 {
-	state->outgoingPacketSize = 0;
-	writeBufferU8( state->outgoingPacketBuffer, &state->outgoingPacketSize, type );
-	writeBufferU16( state->outgoingPacketBuffer, &state->outgoingPacketSize, ackId );
-	writeBufferU32( state->outgoingPacketBuffer, &state->outgoingPacketSize, salt );
+	reader->block->incomingReadOffset = reader->readOffset - reader->scratchBits / 8;
+	reader->scratch = 0;
+	reader->scratchBits = 0;
+	reader->readOffset = reader->block->incomingReadOffset;
+	return !reader->overflow;
 }
 
-static void sendPacket( struct JavelinState* state, struct sockaddr_storage* address )
+static javelin_u32 getBits( struct JavelinBitReader* reader, const javelin_u32 bitCount )
 {
-	int result = sendto( state->socket, state->outgoingPacketBuffer, state->outgoingPacketSize, 0, (struct sockaddr*)address, sizeof (struct sockaddr_storage) );
-	if ( result < 0 ) {
-		// TODO: Do we care about this error? Count errors towards a forced disconnect?
-		if ( VERBOSE ) printf( "net: sendto error: %i\n", errno );
+	if ( reader->overflow ) {
+		return 0;
+	}
+	if ( reader->scratchBits < bitCount ) {
+		// Refilled a word at a time, or with whatever is left near the end of the message
+		const struct JavelinMessageBlock* block = reader->block;
+		const size_t remaining = block->size - reader->readOffset;
+		const size_t byteCount = remaining < sizeof (javelin_u32) ? remaining : sizeof (javelin_u32);
+		reader->scratch |= loadWord( &javelinGetMessageData( block )[reader->readOffset], byteCount ) << reader->scratchBits;
+		reader->scratchBits += byteCount * 8;
+		reader->readOffset += byteCount;
+		if ( reader->scratchBits < bitCount ) {
+			reader->overflow = true;
+			return 0;
+		}
 	}
+	const javelin_u32 value = (javelin_u32)(reader->scratch & lowBitMask( bitCount ));
+	reader->scratch >>= bitCount;
+	reader->scratchBits -= bitCount;
+	return value;
 }
 
-enum JavelinError javelinConnect( struct JavelinState* state, const char* address, const javelin_u16 port )
+javelin_u32 javelinReadBits( struct JavelinBitReader* reader, const javelin_u32 bitCount )
 {
-	if ( address == NULL || port == 0 ) {
-		return JAVELIN_ERROR_INVALID_ADDRESS;
-	}
+	return bitCount <= 32 ? getBits( reader, bitCount ) : 0;
+}
 
-	struct JavelinConnection* connection = NULL;
-	for ( size_t i = 0; i < state->connectionLimit; i++ ) {
-		if ( state->connectionSlots[i].isActive ) {
-			continue;
+bool javelinReadBool( struct JavelinBitReader* reader )
+{
+	return getBits( reader, 1 ) != 0;
+}
+
+javelin_u64 javelinReadVarU64( struct JavelinBitReader* reader )
+{
+	javelin_u64 value = 0;
+	for ( javelin_u32 shift = 0; shift < 64; shift += 7 ) {
+		const javelin_u32 group = getBits( reader, 8 );
+		value |= (javelin_u64)(group & 0x7f) << shift;
+		if ( (group & 0x80) == 0 ) {
+			return value;
 		}
-		connection = &state->connectionSlots[i];
-		memset( connection, 0, sizeof (struct JavelinConnection) );
-		connection->slot = i;
-		break;
 	}
-	if ( connection == NULL ) {
-		return JAVELIN_ERROR_CONNECTION_LIMIT;
-	}
-
-	char portString[10];
-	snprintf( portString, sizeof (portString), "%i", port );
+	reader->overflow = true;	// too many groups for a 64 bit value
+	return 0;
+}
 
-	struct addrinfo hints = {0};
-	hints.ai_family = state->address.ss_family;
-	hints.ai_socktype = SOCK_DGRAM;
+javelin_s64 javelinReadVarS64( struct JavelinBitReader* reader )
+{
+	const javelin_u64 value = javelinReadVarU64( reader );
+	return (javelin_s64)((value >> 1) ^ (0 - (value & 1)));
+}
 
-	struct addrinfo* addr;
-	int aiStatus = getaddrinfo( address, portString, &hints, &addr );
-	if ( aiStatus != 0 || addr == NULL ) {
-		return JAVELIN_ERROR_GETADDRINFO;
+javelin_s32 javelinReadRanged( struct JavelinBitReader* reader, const javelin_s32 min, const javelin_s32 max )
+{
+	if ( max < min ) {
+		return min;
 	}
+	const javelin_u32 value = getBits( reader, bitsRequired( (javelin_u64)((javelin_s64)max - min) ) );
+	return (javelin_s32)((javelin_s64)min + value);
+}
 
-	if ( addr->ai_family == AF_INET ) {
-		memcpy( &connection->address, addr->ai_addr, sizeof (struct sockaddr_in) );
+float javelinReadFloat( struct JavelinBitReader* reader )
+{
+	const javelin_u32 bits = getBits( reader, 32 );
+	float value;
+	memcpy( &value, &bits, sizeof (value) );
+	return value;
+}
+
+float javelinReadQuantized( struct JavelinBitReader* reader, const float min, const float max, const javelin_u32 bitCount )
+{
+	float value = min;
+	javelinReadQuantizedArray( reader, &value, 1, min, max, bitCount );
+	return value;
+}
+
+void javelinReadQuantizedArray( struct JavelinBitReader* reader, float* values, const size_t count, const float min, const float max, const javelin_u32 bitCount )
+{
+	if ( bitCount == 0 || bitCount > 32 || !(max > min) ) {
+		return;
 	}
-	else {
-		memcpy( &connection->address, addr->ai_addr, sizeof (struct sockaddr_in6) );
+	for ( size_t i = 0; i < count; i++ ) {
+		values[i] = dequantize( getBits( reader, bitCount ), min, max, bitCount );
 	}
+}
 
-	javelin_u64 currentTimeMs = getCurrentTime();
+static javelin_u64 getWallClockTime( void )
+{
+	struct timespec ts;
+	timespec_get( &ts, TIME_UTC );
+	return ((javelin_u64)ts.tv_sec * 1000 + (ts.tv_nsec / 1000000));
+}
 
-	connection->isActive = true;
-	connection->connectionState = JAVELIN_CONNECTIONSTATE_CONNECTING;
-	connection->retryTime = JAVELIN_DEFAULT_RETRY_TIME_MS;
-	connection->localSalt = state->randomGenerator();
-	if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_REQUEST\n" );
-	writePacketHeader( state, JAVELIN_PACKET_CONNECT_REQUEST, 0, connection->localSalt );
-	sendPacket( state, &connection->address );
-	connection->lastSendTime = currentTimeMs;
-	connection->lastReceiveTime = currentTimeMs;
+// Milliseconds from config.clock if one was given, otherwise from the wall clock
+static javelin_u64 getCurrentTime( const struct JavelinState* state )
+{
+	if ( state->config.clock != NULL ) {
+		return state->config.clock( state->config.clockContext );
+	}
+	return getWallClockTime();
+}
 
-	freeaddrinfo( addr );
-	return JAVELIN_ERROR_OK;
+#if JAVELIN_TRACE
+static void traceMessage( struct JavelinState* state, struct JavelinConnection* connection, const enum JavelinTraceType type, const javelin_u32 channel, const javelin_u16 messageId, const javelin_u64 timeMs )
+{
+	if ( state->config.trace != NULL ) {
+		state->config.trace( state->config.traceContext, connection, type, channel, messageId, timeMs );
+	}
 }
 
-void javelinDisconnect( struct JavelinState* state )
+static void addHistogramSample( struct JavelinHistogram* histogram, const javelin_u64 intervalMs )
 {
-	// TODO: Consider whether we need to use this on the server side to disconnect all clients
-	struct JavelinConnection* connection = NULL;
-	for ( size_t i = 0; i < state->connectionLimit; i++ ) {
-		if ( !state->connectionSlots[i].isActive ) {
-			continue;
-		}
-		connection = &state->connectionSlots[i];
-		break;
+	javelin_u32 bucket = 0;
+	while ( bucket < JAVELIN_HISTOGRAM_BUCKETS - 1 && (intervalMs >> bucket) != 0 ) {
+		bucket++;
 	}
-	if ( connection == NULL ) {
-		return;
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	if ( intervalMs > histogram->max ) {
+		histogram->max = intervalMs > UINT32_MAX ? UINT32_MAX : (javelin_u32)intervalMs;
 	}
-	connection->connectionState = JAVELIN_CONNECTIONSTATE_DISCONNECTING;
-	// TODO: decide when we're fully disconnected
-	if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_DISCONNECT\n" );
-	writePacketHeader( state, JAVELIN_PACKET_DISCONNECT, 0, calculateSalt( connection ) );
-	sendPacket( state, &connection->address );
 }
+#endif
 
 static bool isSameConnection( struct sockaddr_storage* first, struct sockaddr_storage* second )
 {
@@ -467,358 +645,3457 @@ static bool isSameConnection( struct sockaddr_storage* first, struct sockaddr_st
 	return false;
 }
 
-static bool idIsGreater( const javelin_u32 first, javelin_u32 second )
+// Seeded per table, so a remote peer can't pick addresses that all land in one probe sequence
+static javelin_u32 hashAddress( const struct sockaddr_storage* address, const javelin_u32 seed )
 {
-	return ((first > second) && (first - second <= (1 << 15))) ||
-			((first < second) && (second - first > (1 << 15)));
+	// FNV-1a over the address and port, starting from the seed
+	javelin_u32 hash = 2166136261u ^ seed;
+	const javelin_u8* bytes = NULL;
+	size_t length = 0;
+	javelin_u16 port = 0;
+	if ( address->ss_family == AF_INET ) {
+		const struct sockaddr_in* address4 = (const struct sockaddr_in*)address;
+		bytes = (const javelin_u8*)&address4->sin_addr.s_addr;
+		length = 4;
+		port = address4->sin_port;
+	}
+	else if ( address->ss_family == AF_INET6 ) {
+		const struct sockaddr_in6* address6 = (const struct sockaddr_in6*)address;
+		bytes = address6->sin6_addr.s6_addr;
+		length = 16;
+		port = address6->sin6_port;
+	}
+	for ( size_t i = 0; i < length; i++ ) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	hash = (hash ^ (port & 0xff)) * 16777619u;
+	hash = (hash ^ (port >> 8)) * 16777619u;
+	// Finish with a full avalanche, since the table only looks at the low bits
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return hash;
 }
 
-bool javelinProcess( struct JavelinState* state, struct JavelinEvent* outEvent )
+static bool addressTableCreate( struct JavelinAddressTable* table, const javelin_u32 maxEntries, const javelin_u32 seed )
 {
-	javelin_u64 currentTimeMs = getCurrentTime();
+	// Keep the load factor at or below one half so probe sequences stay short
+	javelin_u32 capacity = 1;
+	while ( capacity < maxEntries * 2 ) {
+		capacity <<= 1;
+	}
+	table->entries = (struct JavelinAddressEntry*)calloc( capacity, sizeof (struct JavelinAddressEntry) );
+	if ( table->entries == NULL ) {
+		return false;
+	}
+	table->mask = capacity - 1;
+	table->seed = seed;
+	return true;
+}
 
-	// TODO: add unreliable message buffer
-	// TODO: add bandwidth tracking to adjust packet size or number sent
+static void addressTableDestroy( struct JavelinAddressTable* table )
+{
+	free( table->entries );
+	table->entries = NULL;
+	table->mask = 0;
+}
 
-	for ( size_t slot = 0; slot < state->connectionLimit; slot++ ) {
-		struct JavelinConnection* connection = &state->connectionSlots[slot];
-		if ( !connection->isActive ) {
-			continue;
-		}
-		if ( connection->outgoingLastIdSent == connection->outgoingLastIdAcknowledged ) {
-			continue;
+static javelin_s32 addressTableFind( const struct JavelinAddressTable* table, struct sockaddr_storage* address )
+{
+	const javelin_u32 hash = hashAddress( address, table->seed );
+	for ( javelin_u32 i = hash & table->mask; ; i = (i + 1) & table->mask ) {
+		const struct JavelinAddressEntry* entry = &table->entries[i];
+		if ( entry->address == NULL ) {
+			return -1;
 		}
-		size_t messageIndex = (connection->outgoingLastIdAcknowledged + 1) % JAVELIN_MAX_MESSAGES;
-		size_t lastIndex = (connection->outgoingLastIdSent + 1) % JAVELIN_MAX_MESSAGES;
-		while ( messageIndex != lastIndex ) {
-			writePacketHeader( state, JAVELIN_PACKET_DATA, connection->incomingLastIdProcessed, calculateSalt( connection ) );
-			bool messagesToSend = false;
-			while ( messageIndex != lastIndex ) {
-				struct JavelinMessageBlock* block = &connection->outgoingMessageBuffer[messageIndex];
-				if ( state->outgoingPacketSize + sizeof (javelin_u16) + sizeof (javelin_u16) + block->size > JAVELIN_MAX_PACKET_SIZE ) {
-					break;
-				}
-				if ( block->outgoingLastSendTime == 0 || (currentTimeMs - block->outgoingLastSendTime) > connection->retryTime ) {
-					if ( VERBOSE ) printf( "net: queuing message to send: id = %i, size = %zu\n", block->messageId, block->size );
-					// message header
-					writeBufferU16( state->outgoingPacketBuffer, &state->outgoingPacketSize, block->messageId );
-					writeBufferU16( state->outgoingPacketBuffer, &state->outgoingPacketSize, block->size );
-					memcpy( &state->outgoingPacketBuffer[state->outgoingPacketSize], block->payload, block->size );
-					state->outgoingPacketSize += block->size;
-					block->outgoingLastSendTime = currentTimeMs;
-					messagesToSend = true;
-				}
-				messageIndex = (messageIndex + 1) % JAVELIN_MAX_MESSAGES;
-			}
-			if ( messagesToSend ) {
-				if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_DATA\n" );
-				sendPacket( state, &connection->address );
-				connection->lastSendTime = currentTimeMs;
-			}
+		if ( entry->hash == hash && isSameConnection( address, entry->address ) ) {
+			return entry->index;
 		}
 	}
+}
 
-	// Scan all connections for connection packets to resend
-	for ( size_t slot = 0; slot < state->connectionLimit; slot++ ) {
-		struct JavelinConnection* connection = &state->connectionSlots[slot];
-		if ( !connection->isActive ) {
-			continue;
-		}
-		if ( currentTimeMs - connection->lastSendTime < connection->retryTime ) {
-			continue;
-		}
+static void addressTableInsert( struct JavelinAddressTable* table, struct sockaddr_storage* address, const javelin_u32 index )
+{
+	const javelin_u32 hash = hashAddress( address, table->seed );
+	javelin_u32 i = hash & table->mask;
+	while ( table->entries[i].address != NULL ) {
+		i = (i + 1) & table->mask;
+	}
+	table->entries[i].address = address;
+	table->entries[i].hash = hash;
+	table->entries[i].index = index;
+}
 
-		if ( connection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTING ) {
-			if ( connection->remoteSalt == 0 ) {
-				if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_REQUEST\n" );
-				writePacketHeader( state, JAVELIN_PACKET_CONNECT_REQUEST, 0, connection->localSalt );
-				sendPacket( state, &connection->address );
-				connection->lastSendTime = currentTimeMs;
-			}
-			else {
-				if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE\n" );
-				writePacketHeader( state, JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE, 0, calculateSalt( connection ) );
-				sendPacket( state, &connection->address );
-				connection->lastSendTime = currentTimeMs;
-			}
+static void addressTableRemove( struct JavelinAddressTable* table, struct sockaddr_storage* address )
+{
+	const javelin_u32 hash = hashAddress( address, table->seed );
+	javelin_u32 i = hash & table->mask;
+	while ( table->entries[i].address != address ) {
+		if ( table->entries[i].address == NULL ) {
+			return;
 		}
+		i = (i + 1) & table->mask;
 	}
 
-	// Scan all connections and pendingConnections for timeouts
-	size_t pendingConnectionIndex = 0;
-	while ( pendingConnectionIndex < state->pendingConnectionCount ) {
-		struct JavelinPendingConnection* pendingConnection = &state->pendingConnectionSlots[pendingConnectionIndex];
-		if ( currentTimeMs - pendingConnection->lastReceiveTime >= JAVELIN_CONNECTION_TIMEOUT_MS ) {
-			if ( VERBOSE ) printf( "net: pending connection timeout: %zu\n", pendingConnectionIndex );
-			*pendingConnection = state->pendingConnectionSlots[--state->pendingConnectionCount];
-		}
-		else {
-			pendingConnectionIndex++;
+	// Backward shift deletion, so lookups never need tombstones
+	javelin_u32 next = (i + 1) & table->mask;
+	while ( table->entries[next].address != NULL ) {
+		const javelin_u32 home = table->entries[next].hash & table->mask;
+		if ( ((next - home) & table->mask) >= ((next - i) & table->mask) ) {
+			table->entries[i] = table->entries[next];
+			i = next;
 		}
+		next = (next + 1) & table->mask;
 	}
-	for ( size_t slot = 0; slot < state->connectionLimit; slot++ ) {
-		struct JavelinConnection* connection = &state->connectionSlots[slot];
-		if ( !connection->isActive ) {
-			continue;
-		}
-		if ( currentTimeMs - connection->lastReceiveTime >= JAVELIN_CONNECTION_TIMEOUT_MS ) {
-			if ( VERBOSE ) printf( "connection timeout for slot %zu\n", slot );
-			connection->isActive = false;
-			connection->connectionState = JAVELIN_CONNECTIONSTATE_DISCONNECTED;
-			outEvent->connection = connection;
-			outEvent->type = JAVELIN_EVENT_DISCONNECT;
-			return true;
+	table->entries[i].address = NULL;
+}
+
+static javelin_u64 simulatorClock( void* context )
+{
+	return ((const struct JavelinSimulator*)context)->time;
+}
+
+// xorshift64*, so a seed always gives the same sequence on every platform
+static javelin_u32 simulatorRandom( struct JavelinSimulator* simulator )
+{
+	simulator->randomState ^= simulator->randomState >> 12;
+	simulator->randomState ^= simulator->randomState << 25;
+	simulator->randomState ^= simulator->randomState >> 27;
+	return (javelin_u32)((simulator->randomState * 2685821657736338717ull) >> 32);
+}
+
+static bool simulatorChance( struct JavelinSimulator* simulator, const float rate )
+{
+	if ( rate <= 0.0f ) {
+		return false;
+	}
+	return (simulatorRandom( simulator ) >> 8) < (javelin_u32)(rate * (float)(1 << 24));
+}
+
+static bool isSimulatedPacketEarlier( const struct JavelinSimulatedPacket* a, const struct JavelinSimulatedPacket* b )
+{
+	return a->deliveryTime < b->deliveryTime || (a->deliveryTime == b->deliveryTime && a->sequence < b->sequence);
+}
+
+static struct JavelinSimulatedEndpoint* findSimulatedEndpoint( const struct JavelinState* state )
+{
+	const javelin_s32 index = addressTableFind( &state->simulator->endpointTable, (struct sockaddr_storage*)&state->address );
+	return index >= 0 ? &state->simulator->endpoints[index] : NULL;
+}
+
+static void pushSimulatedPacket( struct JavelinSimulator* simulator, struct JavelinSimulatedEndpoint* endpoint, const struct JavelinState* sender, const javelin_u64 deliveryTime )
+{
+	if ( endpoint->packetCount == endpoint->packetCapacity ) {
+		const javelin_u32 capacity = endpoint->packetCapacity > 0 ? endpoint->packetCapacity * 2 : 64;
+		struct JavelinSimulatedPacket* packets = (struct JavelinSimulatedPacket*)realloc( endpoint->packets, capacity * sizeof (struct JavelinSimulatedPacket) );
+		if ( packets == NULL ) {
+			simulator->packetsLost++;
+			return;
 		}
-		else if ( currentTimeMs - connection->lastSendTime >= connection->retryTime && connection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTED ) {
-			if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_PING (%i)\n", connection->incomingLastIdProcessed );
-			writePacketHeader( state, JAVELIN_PACKET_PING, connection->incomingLastIdProcessed, calculateSalt( connection ) );
-			sendPacket( state, &connection->address );
-			connection->lastSendTime = currentTimeMs;
+		endpoint->packets = packets;
+		endpoint->packetCapacity = capacity;
+	}
+
+	javelin_u32 i = endpoint->packetCount++;
+	while ( i > 0 ) {
+		const javelin_u32 parent = (i - 1) / 2;
+		if ( endpoint->packets[parent].deliveryTime <= deliveryTime ) {
+			break;
 		}
+		endpoint->packets[i] = endpoint->packets[parent];
+		i = parent;
 	}
+	struct JavelinSimulatedPacket* entry = &endpoint->packets[i];
+	entry->deliveryTime = deliveryTime;
+	entry->sequence = simulator->nextSequence++;
+	memcpy( &entry->packet.address, &sender->address, sizeof (struct sockaddr_storage) );
+	entry->packet.size = sender->outgoingPacketSize;
+	memcpy( entry->packet.data, sender->outgoingPacketBuffer, sender->outgoingPacketSize );
+}
 
-	// Keep reading packets until we have a message to return
+static void popSimulatedPacket( struct JavelinSimulatedEndpoint* endpoint )
+{
+	const struct JavelinSimulatedPacket* last = &endpoint->packets[--endpoint->packetCount];
+	javelin_u32 i = 0;
 	while ( true ) {
-		struct JavelinConnection* lastPacketConnection = &state->connectionSlots[state->incomingLastPacketSlot];
-		const javelin_u32 nextIndex = (lastPacketConnection->incomingLastIdProcessed + 1) & 0xffff;
-		const javelin_u32 messageIndex = nextIndex % JAVELIN_MAX_MESSAGES;
-		if ( lastPacketConnection->incomingMessageBuffer[messageIndex].messageId == nextIndex ) {
-			if ( VERBOSE ) printf( "returning queued message %u\n", lastPacketConnection->incomingMessageBuffer[messageIndex].messageId );
-			outEvent->connection = lastPacketConnection;
-			outEvent->type = JAVELIN_EVENT_DATA;
-			outEvent->message = &lastPacketConnection->incomingMessageBuffer[messageIndex];
-			lastPacketConnection->incomingLastIdProcessed = nextIndex;
-			return true;
+		javelin_u32 child = i * 2 + 1;
+		if ( child >= endpoint->packetCount ) {
+			break;
 		}
-
-		struct sockaddr_storage fromAddress;
-		int fromLength = sizeof (fromAddress);
-		javelin_u8 packetBuffer[JAVELIN_MAX_PACKET_SIZE];
-		int receivedLength = recvfrom( state->socket, packetBuffer, JAVELIN_MAX_PACKET_SIZE, 0, (struct sockaddr*)&fromAddress, (socklen_t*)&fromLength );
-		if ( receivedLength <= 0 ) {
-			if ( receivedLength == -1 && errno != EAGAIN && errno != EWOULDBLOCK ) {
-				// TODO: Do we care about this error? Count errors towards a forced disconnect?
-				if ( VERBOSE ) printf( "net: recvfrom error: %i\n", errno );
-			}
-			return false;
+		if ( child + 1 < endpoint->packetCount && isSimulatedPacketEarlier( &endpoint->packets[child + 1], &endpoint->packets[child] ) ) {
+			child++;
+		}
+		if ( !isSimulatedPacketEarlier( &endpoint->packets[child], last ) ) {
+			break;
 		}
+		endpoint->packets[i] = endpoint->packets[child];
+		i = child;
+	}
+	if ( i != endpoint->packetCount ) {
+		endpoint->packets[i] = *last;
+	}
+}
 
-		size_t readOffset = 0;
-		struct JavelinPacketHeader packetHeader;
-		packetHeader.type = readBufferU8( packetBuffer, &readOffset );
-		packetHeader.ackMessageId = readBufferU16( packetBuffer, &readOffset );
-		packetHeader.salt = readBufferU32( packetBuffer, &readOffset );
+// Hands the packet waiting in outgoingPacketBuffer to the simulator instead of the socket
+static void simulatePacket( struct JavelinState* state, struct sockaddr_storage* address )
+{
+	struct JavelinSimulator* simulator = state->simulator;
+	const struct JavelinLinkConditions* conditions = &simulator->conditions;
+	simulator->packetsSent++;
+	if ( simulatorChance( simulator, conditions->lossRate ) ) {
+		simulator->packetsLost++;
+		return;
+	}
+	const javelin_s32 index = addressTableFind( &simulator->endpointTable, address );
+	if ( index < 0 ) {
+		// Nobody there, like a closed port
+		return;
+	}
 
-		struct JavelinConnection* packetConnection = NULL;
-		for ( size_t slot = 0; slot < state->connectionLimit; slot++ ) {
-			struct JavelinConnection* connection = &state->connectionSlots[slot];
-			if ( !connection->isActive ) {
-				continue;
-			}
-			if ( isSameConnection( &fromAddress, &connection->address ) ) {
-				packetConnection = connection;
-				state->incomingLastPacketSlot = slot;
-				break;
-			}
+	javelin_u32 copies = 1;
+	if ( simulatorChance( simulator, conditions->duplicateRate ) ) {
+		simulator->packetsDuplicated++;
+		copies = 2;
+	}
+	for ( javelin_u32 i = 0; i < copies; i++ ) {
+		javelin_u64 delay = conditions->latencyMs;
+		if ( conditions->jitterMs > 0 ) {
+			delay += simulatorRandom( simulator ) % (conditions->jitterMs + 1);
 		}
+		if ( simulatorChance( simulator, conditions->reorderRate ) ) {
+			// Late enough that anything sent in the meantime overtakes it
+			delay += (javelin_u64)conditions->latencyMs + conditions->jitterMs + 1;
+		}
+		pushSimulatedPacket( simulator, &simulator->endpoints[index], state, simulator->time + delay );
+	}
+}
 
-		if ( packetConnection == NULL ) {
-			struct JavelinPendingConnection* pendingConnection = NULL;
-			for ( size_t slot = 0; slot < state->pendingConnectionCount; slot++ ) {
-				struct JavelinPendingConnection* connection = &state->pendingConnectionSlots[slot];
-				if ( connection->connectionState == JAVELIN_CONNECTIONSTATE_NONE ) {
-					continue;
-				}
-				if ( isSameConnection( &fromAddress, &connection->address ) ) {
-					pendingConnection = connection;
-					break;
-				}
-			}
-			if ( pendingConnection == NULL ) {
-				if ( state->pendingConnectionCount == JAVELIN_MAX_PENDING_CONNECTIONS ) {
-					if ( VERBOSE ) printf( "net: server full: %i = %i\n", state->pendingConnectionCount, JAVELIN_MAX_PENDING_CONNECTIONS );
-					writePacketHeader( state, JAVELIN_PACKET_SERVER_FULL, 0, packetHeader.salt );
-					sendPacket( state, &fromAddress );
-					continue;	// next packet, no room for another connection attempt
-				}
-				if ( VERBOSE ) printf( "net: new pending slot: %i\n", state->pendingConnectionCount );
-				pendingConnection = &state->pendingConnectionSlots[state->pendingConnectionCount++];
-				memset( pendingConnection, 0, sizeof (struct JavelinPendingConnection) );
-				pendingConnection->address = fromAddress;
-				pendingConnection->connectionState = JAVELIN_CONNECTIONSTATE_NONE;
-				pendingConnection->localSalt = state->randomGenerator();
-			}
-			pendingConnection->lastReceiveTime = currentTimeMs;
-			if ( packetHeader.type == JAVELIN_PACKET_CONNECT_REQUEST ) {
-				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_CONNECT_REQUEST\n" );
-				if ( packetHeader.salt != 0 ) {
-					pendingConnection->remoteSalt = packetHeader.salt;
-					pendingConnection->connectionState = JAVELIN_CONNECTIONSTATE_CONNECTING;
-					if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_CHALLENGE\n" );
-					writePacketHeader( state, JAVELIN_PACKET_CONNECT_CHALLENGE, 0, pendingConnection->remoteSalt );
-					writeBufferU32( state->outgoingPacketBuffer, &state->outgoingPacketSize, pendingConnection->localSalt );
-					sendPacket( state, &pendingConnection->address );
-					pendingConnection->lastSendTime = currentTimeMs;
-				}
-			}
-			else if ( packetHeader.type == JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE && pendingConnection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTING ) {
-				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE\n" );
-				if ( (packetHeader.salt ^ pendingConnection->remoteSalt) != pendingConnection->localSalt ) {
-					if ( VERBOSE ) printf( "net: bad salt\n" );
-					continue;	// next packet
-				}
-
-				javelin_s32 availableSlot = -1;
-				for ( size_t slot = 0; slot < state->connectionLimit; slot++ ) {
-					struct JavelinConnection* connection = &state->connectionSlots[slot];
-					if ( !connection->isActive ) {
-						availableSlot = slot;
-						break;
-					}
-				}
-				if ( availableSlot == -1 ) {
-					// TODO: send "server full" packet
-					if ( VERBOSE ) printf( "net: server full\n" );
-					*pendingConnection = state->pendingConnectionSlots[--state->pendingConnectionCount];
-					continue;	// next packet
-				}
-				struct JavelinConnection* connection = &state->connectionSlots[availableSlot];
-				memset( connection, 0, sizeof (struct JavelinConnection) );
-				connection->isActive = true;
-				connection->slot = availableSlot;
-				connection->address = pendingConnection->address;
-				connection->connectionState = JAVELIN_CONNECTIONSTATE_CONNECTED;
-				connection->localSalt = pendingConnection->localSalt;
-				connection->remoteSalt = pendingConnection->remoteSalt;
-				connection->retryTime = JAVELIN_DEFAULT_RETRY_TIME_MS;
+// Moves packets that are due from the simulator into incomingPackets, returning how many
+static javelin_u32 receiveSimulatedPackets( struct JavelinState* state )
+{
+	struct JavelinSimulatedEndpoint* endpoint = findSimulatedEndpoint( state );
+	if ( endpoint == NULL ) {
+		return 0;
+	}
+	const javelin_u32 maxPackets = sizeof (state->incomingPackets) / sizeof (state->incomingPackets[0]);
+	javelin_u32 count = 0;
+	while ( count < maxPackets && endpoint->packetCount > 0 && endpoint->packets[0].deliveryTime <= state->simulator->time ) {
+		state->incomingPackets[count++] = endpoint->packets[0].packet;
+		popSimulatedPacket( endpoint );
+		state->simulator->packetsDelivered++;
+	}
+	return count;
+}
 
-				if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_ACCEPT\n" );
-				writePacketHeader( state, JAVELIN_PACKET_CONNECT_ACCEPT, 0, calculateSalt( connection ) );
-				sendPacket( state, &connection->address );
-				connection->lastSendTime = currentTimeMs;
-				connection->lastReceiveTime = currentTimeMs;
+static void removePendingConnection( struct JavelinState* state, const javelin_u32 index )
+{
+	struct JavelinPendingConnection* pendingConnection = &state->pendingConnectionSlots[index];
+	struct JavelinPendingConnection* lastPendingConnection = &state->pendingConnectionSlots[--state->pendingConnectionCount];
+	addressTableRemove( &state->pendingConnectionTable, &pendingConnection->address );
+	if ( pendingConnection != lastPendingConnection ) {
+		addressTableRemove( &state->pendingConnectionTable, &lastPendingConnection->address );
+		*pendingConnection = *lastPendingConnection;
+		addressTableInsert( &state->pendingConnectionTable, &pendingConnection->address, index );
+	}
+}
 
-				outEvent->connection = connection;
-				outEvent->type = JAVELIN_EVENT_CONNECT;
-				return true;
-			}
+static void timerHeapSet( struct JavelinState* state, const javelin_u32 index, const struct JavelinTimer timer )
+{
+	state->timerHeap[index] = timer;
+	state->connectionSlots[timer.slot].timerIndex = index + 1;
+}
 
-			continue;	// next packet
+static void timerHeapSiftUp( struct JavelinState* state, javelin_u32 index )
+{
+	const struct JavelinTimer timer = state->timerHeap[index];
+	while ( index > 0 ) {
+		const javelin_u32 parent = (index - 1) / 2;
+		if ( state->timerHeap[parent].time <= timer.time ) {
+			break;
 		}
+		timerHeapSet( state, index, state->timerHeap[parent] );
+		index = parent;
+	}
+	timerHeapSet( state, index, timer );
+}
 
-		packetConnection->lastReceiveTime = currentTimeMs;
-		if ( idIsGreater( packetHeader.ackMessageId, packetConnection->outgoingLastIdAcknowledged ) ) {
-			packetConnection->outgoingLastIdAcknowledged = packetHeader.ackMessageId;
-			if ( VERBOSE ) printf( "net: acknowledged up to %u\n", packetConnection->outgoingLastIdAcknowledged );
+static void timerHeapSiftDown( struct JavelinState* state, javelin_u32 index )
+{
+	const struct JavelinTimer timer = state->timerHeap[index];
+	while ( true ) {
+		javelin_u32 child = index * 2 + 1;
+		if ( child >= state->timerCount ) {
+			break;
 		}
-		if ( packetConnection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTING ) {
-			if ( packetHeader.type == JAVELIN_PACKET_CONNECT_CHALLENGE ) {
-				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_CONNECT_CHALLENGE\n" );
-				if ( packetHeader.salt == packetConnection->localSalt ) {
-					packetConnection->remoteSalt = readBufferU32( packetBuffer, &readOffset );
-					if ( packetConnection->remoteSalt != 0 ) {
-						if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE\n" );
-						writePacketHeader( state, JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE, 0, calculateSalt( packetConnection ) );
-						sendPacket( state, &packetConnection->address );
-						packetConnection->lastSendTime = currentTimeMs;
-					}
-				}
-			}
-			else if ( packetHeader.type == JAVELIN_PACKET_CONNECT_ACCEPT && isSaltGood( packetConnection, packetHeader.salt ) ) {
-				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_CONNECT_ACCEPT\n" );
-				packetConnection->connectionState = JAVELIN_CONNECTIONSTATE_CONNECTED;
-				outEvent->connection = packetConnection;
-				outEvent->type = JAVELIN_EVENT_CONNECT;
-				return true;
-			}
-			else if ( packetHeader.type == JAVELIN_PACKET_CONNECT_REJECT && isSaltGood( packetConnection, packetHeader.salt ) ) {
-				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_CONNECT_REJECT\n" );
-				packetConnection->connectionState = JAVELIN_CONNECTIONSTATE_DISCONNECTED;
-				outEvent->connection = packetConnection;
-				outEvent->type = JAVELIN_EVENT_DISCONNECT;
-				return true;
-			}
+		if ( child + 1 < state->timerCount && state->timerHeap[child + 1].time < state->timerHeap[child].time ) {
+			child++;
 		}
-		else if ( packetConnection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTED && isSaltGood( packetConnection, packetHeader.salt ) ) {
-			if ( packetHeader.type == JAVELIN_PACKET_DATA ) {
-				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_DATA\n" );
-				while ( readOffset < (size_t)receivedLength ) {
-					// message header
-					const javelin_u16 id = readBufferU16( packetBuffer, &readOffset );
-					const javelin_u32 size = readBufferU16( packetBuffer, &readOffset );
-					if ( VERBOSE ) printf( "     received message: id = %i, size = %i\n", id, size );
-					if ( readOffset + size > (size_t)receivedLength ) {
-						// If reported size is bad, ignore the rest of the packet
-						if ( VERBOSE ) printf( "     reported size %zu larger than %u, aborting packet\n", readOffset + size, receivedLength );
-						break;
-					}
-					if ( id - packetConnection->incomingLastIdProcessed < JAVELIN_MAX_MESSAGES ) {
-						if ( VERBOSE ) printf( "     storing message %u (to slot %u)\n", id, id % JAVELIN_MAX_MESSAGES );
-						struct JavelinMessageBlock* block = &packetConnection->incomingMessageBuffer[id % JAVELIN_MAX_MESSAGES];
-						block->messageId = id;
-						block->incomingReadOffset = 0;
-						block->size = size;
-						memcpy( block->payload, &packetBuffer[readOffset], size );
-					}
-					else {
-						if ( VERBOSE ) printf( "     ignoring message %u (too old)\n", id );
-					}
-					readOffset += size;
-				}
-			}
-			else if ( packetHeader.type == JAVELIN_PACKET_PING ) {
-				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_PING\n" );
-				// nothing
-			}
-			else if ( packetHeader.type == JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE ) {
-				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE\n" );
-				// We think the client is already connected, but they may not have received the accept packet
-				if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_ACCEPT\n" );
-				writePacketHeader( state, JAVELIN_PACKET_CONNECT_ACCEPT, 0, calculateSalt( packetConnection ) );
-				sendPacket( state, &packetConnection->address );
-				packetConnection->lastSendTime = currentTimeMs;
-			}
-			else if ( packetHeader.type == JAVELIN_PACKET_DISCONNECT ) {
-				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_DISCONNECT\n" );
-				packetConnection->isActive = false;
-				packetConnection->connectionState = JAVELIN_CONNECTIONSTATE_DISCONNECTED;
-				outEvent->connection = packetConnection;
-				outEvent->type = JAVELIN_EVENT_DISCONNECT;
-				return true;
-			}
+		if ( timer.time <= state->timerHeap[child].time ) {
+			break;
 		}
+		timerHeapSet( state, index, state->timerHeap[child] );
+		index = child;
 	}
-
-	return false;
+	timerHeapSet( state, index, timer );
 }
 
-struct JavelinMessageBlock javelinCreateMessage( void )
+static void scheduleConnection( struct JavelinState* state, struct JavelinConnection* connection, const javelin_u64 time )
 {
-	// .size field must be initialized to zero before writing to a message
-	return (struct JavelinMessageBlock) { 0 };
+	if ( connection->timerIndex == 0 ) {
+		const javelin_u32 index = state->timerCount++;
+		timerHeapSet( state, index, (struct JavelinTimer) { time, (javelin_u32)connection->slot } );
+		timerHeapSiftUp( state, index );
+		return;
+	}
+	const javelin_u32 index = connection->timerIndex - 1;
+	const javelin_u64 previousTime = state->timerHeap[index].time;
+	state->timerHeap[index].time = time;
+	if ( time < previousTime ) {
+		timerHeapSiftUp( state, index );
+	}
+	else {
+		timerHeapSiftDown( state, index );
+	}
 }
 
-enum JavelinError javelinQueueMessage( struct JavelinConnection* connection, struct JavelinMessageBlock* block )
+static void unscheduleConnection( struct JavelinState* state, struct JavelinConnection* connection )
 {
-	if ( block->size == 0 || block->size > JAVELIN_MAX_MESSAGE_SIZE ) {
-		if ( VERBOSE ) printf( "net: Unable to queue message: invalid\n" );
-		return JAVELIN_ERROR_INVALID_MESSAGE;
+	if ( connection->timerIndex == 0 ) {
+		return;
 	}
-
-	if ( (connection->outgoingLastIdSent - connection->outgoingLastIdAcknowledged) >= JAVELIN_MAX_MESSAGES ) {
-		if ( VERBOSE ) printf( "net: Unable to queue message: buffer full\n" );
-		return JAVELIN_ERROR_MESSAGE_BUFFER_FULL;
+	const javelin_u32 index = connection->timerIndex - 1;
+	connection->timerIndex = 0;
+	if ( index == --state->timerCount ) {
+		return;
 	}
+	const struct JavelinTimer moved = state->timerHeap[state->timerCount];
+	timerHeapSet( state, index, moved );
+	timerHeapSiftUp( state, index );
+	timerHeapSiftDown( state, state->connectionSlots[moved.slot].timerIndex - 1 );
+}
 
-	const javelin_u32 messageIndex = (connection->outgoingLastIdSent + 1) % JAVELIN_MAX_MESSAGES;
-	struct JavelinMessageBlock* outgoingBlock = &connection->outgoingMessageBuffer[messageIndex];
-	memcpy( outgoingBlock->payload, block->payload, block->size );
-	outgoingBlock->size = block->size;
-	outgoingBlock->messageId = ++connection->outgoingLastIdSent & 0xffff;
-	outgoingBlock->outgoingLastSendTime = 0;
-	if ( VERBOSE ) printf( "net: message queued as %i\n", outgoingBlock->messageId );
+static struct JavelinMessageBlock* getMessageBlock( const struct JavelinState* state, javelin_u8* buffer, const javelin_u32 capacity, const javelin_u32 id )
+{
+	return (struct JavelinMessageBlock*)&buffer[(id & (capacity - 1)) * state->messageStride];
+}
+
+static javelin_u8* allocateMessageBuffer( const struct JavelinState* state, const javelin_u32 capacity )
+{
+	// The last entry is padded out to a full struct, so no field access can run past the allocation
+	javelin_u8* buffer = (javelin_u8*)malloc( capacity * state->messageStride + sizeof (struct JavelinMessageBlock) - state->messageStride );
+	if ( buffer == NULL ) {
+		return NULL;
+	}
+	for ( javelin_u32 i = 0; i < capacity; i++ ) {
+		struct JavelinMessageBlock* block = getMessageBlock( state, buffer, capacity, i );
+		block->messageId = INVALID_MESSAGE_ID;
+		block->sharedMessage = NULL;
+		block->incomingData = NULL;
+		block->fragmentCount = 0;
+	}
+	return buffer;
+}
+
+// Incoming rings may hold messages returned by the current javelinPollEvents, so they are freed by the next one
+static void retireIncomingBuffer( struct JavelinState* state, javelin_u8* buffer )
+{
+	if ( buffer == NULL ) {
+		return;
+	}
+	if ( state->retiredBufferCount == state->retiredBufferCapacity ) {
+		const javelin_u32 newCapacity = state->retiredBufferCapacity > 0 ? state->retiredBufferCapacity * 2 : 8;
+		javelin_u8** retiredBuffers = (javelin_u8**)realloc( state->retiredBuffers, newCapacity * sizeof (javelin_u8*) );
+		if ( retiredBuffers == NULL ) {
+			free( buffer );
+			return;
+		}
+		state->retiredBuffers = retiredBuffers;
+		state->retiredBufferCapacity = newCapacity;
+	}
+	state->retiredBuffers[state->retiredBufferCount++] = buffer;
+}
+
+// Grows a message ring to hold at least requiredCapacity entries, keeping any stored messages from firstId onwards
+static bool growMessageBuffer( struct JavelinState* state, javelin_u8** buffer, javelin_u32* capacity, const javelin_u16 firstId, const javelin_u32 requiredCapacity, const bool isIncoming )
+{
+	javelin_u32 newCapacity = *capacity > 0 ? *capacity : state->config.initialMessages;
+	while ( newCapacity < requiredCapacity ) {
+		newCapacity <<= 1;
+	}
+	if ( newCapacity > state->config.maxMessages ) {
+		return false;
+	}
+	javelin_u8* newBuffer = allocateMessageBuffer( state, newCapacity );
+	if ( newBuffer == NULL ) {
+		return false;
+	}
+	for ( javelin_u32 i = 0; i < *capacity; i++ ) {
+		const javelin_u16 id = firstId + i;
+		struct JavelinMessageBlock* block = getMessageBlock( state, *buffer, *capacity, id );
+		if ( block->messageId == id ) {
+			// Fragments never use the payload, their data is held elsewhere
+			const size_t payloadSize = block->sharedMessage != NULL || block->incomingData != NULL || block->fragmentCount > 0 ? 0 : block->size;
+			memcpy( getMessageBlock( state, newBuffer, newCapacity, id ), block, offsetof (struct JavelinMessageBlock, payload) + payloadSize );
+		}
+	}
+	if ( VERBOSE ) printf( "net: message buffer grown from %u to %u\n", *capacity, newCapacity );
+	if ( isIncoming ) {
+		retireIncomingBuffer( state, *buffer );
+	}
+	else {
+		free( *buffer );
+	}
+	*buffer = newBuffer;
+	*capacity = newCapacity;
+	return true;
+}
+
+// Payloads up to config.maxMessageSize come from a free list, larger ones are allocated to fit and freed when released
+static struct JavelinSharedMessage* allocateSharedMessage( struct JavelinState* state, const size_t size )
+{
+	struct JavelinSharedMessage* message = size <= state->config.maxMessageSize ? state->sharedMessageFreeList : NULL;
+	if ( message != NULL ) {
+		state->sharedMessageFreeList = message->nextFree;
+	}
+	else {
+		message = (struct JavelinSharedMessage*)malloc( sizeof (struct JavelinSharedMessage) + (size > state->config.maxMessageSize ? size : state->config.maxMessageSize) );
+		if ( message == NULL ) {
+			return NULL;
+		}
+	}
+	message->nextFree = NULL;
+	message->referenceCount = 0;
+	message->size = size;
+	return message;
+}
+
+static void releaseSharedMessage( struct JavelinState* state, struct JavelinSharedMessage* message )
+{
+	if ( --message->referenceCount > 0 ) {
+		return;
+	}
+	if ( message->size > state->config.maxMessageSize ) {
+		free( message );
+		return;
+	}
+	message->nextFree = state->sharedMessageFreeList;
+	state->sharedMessageFreeList = message;
+}
+
+// Drops references to shared payloads held by outgoing messages from firstId up to and including lastId
+static void releaseOutgoingMessages( struct JavelinState* state, struct JavelinChannel* channel, const javelin_u16 firstId, const javelin_u16 lastId )
+{
+	for ( javelin_u16 id = firstId; channel->outgoingSharedCount > 0 && id != (javelin_u16)(lastId + 1); id++ ) {
+		struct JavelinMessageBlock* block = getMessageBlock( state, channel->outgoingMessageBuffer, channel->outgoingMessageCapacity, id );
+		if ( block->sharedMessage != NULL ) {
+			releaseSharedMessage( state, block->sharedMessage );
+			block->sharedMessage = NULL;
+			channel->outgoingSharedCount--;
+		}
+	}
+}
+
+static void freeMessageBuffers( struct JavelinState* state, struct JavelinConnection* connection )
+{
+	for ( javelin_u32 i = 0; i < JAVELIN_MAX_CHANNELS; i++ ) {
+		struct JavelinChannel* channel = &connection->channels[i];
+		if ( channel->outgoingMessageBuffer != NULL ) {
+			releaseOutgoingMessages( state, channel, channel->outgoingLastIdAcknowledged + 1, channel->outgoingLastIdSent );
+		}
+		// Undelivered fragments hold their own copy of the data, or for fragment 0 the reassembly buffer. Other messages
+		// may be views into a packet
+		for ( javelin_u32 j = 0; j < channel->incomingMessageCapacity; j++ ) {
+			struct JavelinMessageBlock* block = getMessageBlock( state, channel->incomingMessageBuffer, channel->incomingMessageCapacity, j );
+			if ( block->fragmentCount > 0 ) {
+				free( (void*)block->incomingData );
+			}
+		}
+		free( channel->incomingLargeBuffer );
+		channel->incomingLargeBuffer = NULL;
+		retireIncomingBuffer( state, channel->incomingMessageBuffer );
+		channel->incomingMessageBuffer = NULL;
+		channel->incomingMessageCapacity = 0;
+		free( channel->outgoingMessageBuffer );
+		channel->outgoingMessageBuffer = NULL;
+		channel->outgoingMessageCapacity = 0;
+	}
+	free( connection->outgoingUnreliableBuffer );
+	connection->outgoingUnreliableBuffer = NULL;
+	connection->outgoingUnreliableCount = 0;
+}
+
+static void deactivateConnection( struct JavelinState* state, struct JavelinConnection* connection )
+{
+	addressTableRemove( &state->connectionTable, &connection->address );
+	unscheduleConnection( state, connection );
+	freeMessageBuffers( state, connection );
+	if ( state->incomingUnreliablePacket != NULL && state->incomingUnreliableSlot == connection->slot ) {
+		state->incomingUnreliablePacket = NULL;
+	}
+	connection->isActive = false;
+	connection->connectionState = JAVELIN_CONNECTIONSTATE_DISCONNECTED;
+}
+
+// Clears a slot for a new connection, moving its generation on so handles to the previous connection go stale
+static void resetConnectionSlot( struct JavelinConnection* connection )
+{
+	const javelin_u16 generation = connection->generation == UINT16_MAX ? 1 : connection->generation + 1;
+	const size_t resetOffset = offsetof (struct JavelinConnection, isActive);
+	memset( (javelin_u8*)connection + resetOffset, 0, sizeof (struct JavelinConnection) - resetOffset );
+	connection->generation = generation;
+}
+
+// Takes a block from the pool, which always has room for every event one javelinPollEvents call can return
+static struct JavelinMessageBlock* allocateEventMessage( struct JavelinState* state, javelin_u8* ownedData )
+{
+	assert( state->eventMessageCount < state->eventMessageCapacity );
+	struct JavelinEventMessage* entry = &state->eventMessages[state->eventMessageCount++];
+	entry->ownedData = ownedData;
+	entry->block.fragmentCount = 0;
+	return &entry->block;
+}
+
+// Frees whatever the previous poll's event messages held, and makes room for up to maxEvents more.
+// Returns how many events the pool can now cover.
+static size_t resetEventMessages( struct JavelinState* state, const size_t maxEvents )
+{
+	for ( javelin_u32 i = 0; i < state->eventMessageCount; i++ ) {
+		free( state->eventMessages[i].ownedData );
+	}
+	state->eventMessageCount = 0;
+	for ( javelin_u32 i = 0; i < state->retiredBufferCount; i++ ) {
+		free( state->retiredBuffers[i] );
+	}
+	state->retiredBufferCount = 0;
+	if ( maxEvents > state->eventMessageCapacity && maxEvents <= UINT32_MAX ) {
+		struct JavelinEventMessage* eventMessages = (struct JavelinEventMessage*)malloc( maxEvents * sizeof (struct JavelinEventMessage) );
+		if ( eventMessages != NULL ) {
+			free( state->eventMessages );
+			state->eventMessages = eventMessages;
+			state->eventMessageCapacity = (javelin_u32)maxEvents;
+		}
+	}
+	return maxEvents < state->eventMessageCapacity ? maxEvents : state->eventMessageCapacity;
+}
+
+static void freeConcurrentMessages( struct JavelinConcurrentMessage* message )
+{
+	while ( message != NULL ) {
+		struct JavelinConcurrentMessage* next = message->next;
+		free( message );
+		message = next;
+	}
+}
+
+struct JavelinConfig javelinCreateConfig( void )
+{
+	return (struct JavelinConfig) {
+		.maxMessages = JAVELIN_MAX_MESSAGES,
+		.initialMessages = JAVELIN_INITIAL_MESSAGES,
+		.maxMessageSize = JAVELIN_MAX_MESSAGE_SIZE,
+		.maxSendRate = 0,
+		.maxUnreliableMessages = JAVELIN_MAX_UNRELIABLE_MESSAGES,
+		.channelCount = 1,
+		.maxLargeMessageSize = JAVELIN_MAX_LARGE_MESSAGE_SIZE,
+		.flushInterval = 0,
+		.packetBudget = 0,
+		.keepaliveInterval = JAVELIN_KEEPALIVE_INTERVAL_MS,
+		.reusePort = false,
+		.clock = NULL,
+		.clockContext = NULL,
+		.trace = NULL,
+		.traceContext = NULL,
+	};
+}
+
+static bool isPowerOfTwo( const javelin_u32 value )
+{
+	return value != 0 && (value & (value - 1)) == 0;
+}
+
+enum JavelinError javelinCreate( struct JavelinState* state, const char* address, const javelin_u16 port, const javelin_u32 maxConnections, javelin_u32 (*randomGenerator)( void ) )
+{
+	const struct JavelinConfig config = javelinCreateConfig();
+	return javelinCreateWithConfig( state, address, port, maxConnections, randomGenerator, &config );
+}
+
+// Frees everything initializeState() allocated, also after it fails part way. Call once the socket is closed.
+static void freeState( struct JavelinState* state )
+{
+	if ( state->connectionSlots != NULL ) {
+		for ( size_t i = 0; i < state->connectionLimit; i++ ) {
+			freeMessageBuffers( state, &state->connectionSlots[i] );
+		}
+	}
+	free( state->connectionSlots );
+	resetEventMessages( state, 0 );
+	free( state->eventMessages );
+	free( state->retiredBuffers );
+	if ( state->shared != NULL ) {
+		for ( size_t i = 0; i < state->connectionLimit; i++ ) {
+			struct JavelinConcurrentQueue* queue = &state->shared->queues[i];
+			freeConcurrentMessages( atomic_exchange( &queue->head, NULL ) );
+			freeConcurrentMessages( queue->held );
+		}
+#ifndef _WIN32
+		if ( state->shared->wakePipe[0] != 0 ) {
+			close( state->shared->wakePipe[0] );
+			close( state->shared->wakePipe[1] );
+		}
+#endif
+		free( state->shared );
+		state->shared = NULL;
+	}
+	free( state->queuedEvents );
+	while ( state->sharedMessageFreeList != NULL ) {
+		struct JavelinSharedMessage* message = state->sharedMessageFreeList;
+		state->sharedMessageFreeList = message->nextFree;
+		free( message );
+	}
+	addressTableDestroy( &state->connectionTable );
+	addressTableDestroy( &state->pendingConnectionTable );
+	free( state->timerHeap );
+	// Nothing is left to free, so destroying the state again does nothing
+	memset( state, 0, sizeof (struct JavelinState) );
+}
+
+// Everything but the socket, shared by real and simulated states
+static enum JavelinError initializeState( struct JavelinState* state, const javelin_u32 maxConnections, javelin_u32 (*randomGenerator)( void ), const struct JavelinConfig* config )
+{
+	static_assert( JAVELIN_MAX_PACKET_SIZE > sizeof (struct JavelinPacketHeader) + sizeof (javelin_u16) + sizeof (javelin_u16) + JAVELIN_MAX_MESSAGE_SIZE, "Max message size is too large to fit in a packet" );
+	static_assert( (JAVELIN_MAX_MESSAGES & (JAVELIN_MAX_MESSAGES - 1)) == 0, "Max number of messages must be a power of two" );
+	static_assert( JAVELIN_MAX_PACKET_SIZE <= MESSAGE_SIZE_MASK, "Max packet size is too large for the message size field" );
+	static_assert( JAVELIN_MAX_CHANNELS <= MESSAGE_CHANNEL_MASK + 1, "Too many channels for the message header" );
+	static_assert( JAVELIN_MAX_PACKET_SIZE >= PACKET_HEADER_SIZE + JAVELIN_MAX_CHANNELS * PACKET_ACK_SIZE + sizeof (javelin_u16) + sizeof (javelin_u16) + FRAGMENT_HEADER_SIZE + JAVELIN_FRAGMENT_SIZE, "Fragment size is too large to fit in a packet" );
+
+	if ( randomGenerator == NULL ) {
+		return JAVELIN_ERROR_RANDOM_GENERATOR_REQUIRED;
+	}
+	if ( !isPowerOfTwo( config->maxMessages ) || config->maxMessages > (1 << 15) || !isPowerOfTwo( config->initialMessages ) || config->initialMessages > config->maxMessages ) {
+		return JAVELIN_ERROR_INVALID_CONFIG;
+	}
+	if ( config->maxMessageSize == 0 || config->maxMessageSize > JAVELIN_MAX_MESSAGE_SIZE || !isPowerOfTwo( config->maxUnreliableMessages ) ) {
+		return JAVELIN_ERROR_INVALID_CONFIG;
+	}
+	if ( config->channelCount == 0 || config->channelCount > JAVELIN_MAX_CHANNELS ) {
+		return JAVELIN_ERROR_INVALID_CONFIG;
+	}
+	if ( config->keepaliveInterval == 0 || config->keepaliveInterval >= JAVELIN_CONNECTION_TIMEOUT_MS ) {
+		return JAVELIN_ERROR_INVALID_CONFIG;
+	}
+#ifndef SO_REUSEPORT
+	if ( config->reusePort ) {
+		return JAVELIN_ERROR_INVALID_CONFIG;
+	}
+#endif
+	memset( state, 0, sizeof (struct JavelinState) );
+	state->config = *config;
+	state->packetBudgetLeft = config->packetBudget > 0 ? config->packetBudget : UINT32_MAX;
+	state->outgoingPacketBuffer = state->outgoingPackets[0].data;
+	const size_t alignment = _Alignof (struct JavelinMessageBlock);
+	state->messageStride = (offsetof (struct JavelinMessageBlock, payload) + config->maxMessageSize + alignment - 1) / alignment * alignment;
+
+	state->connectionLimit = maxConnections > 0 ? maxConnections : 1;
+	state->connectionSlots = (struct JavelinConnection*)malloc( sizeof (struct JavelinConnection) * state->connectionLimit );
+	if ( state->connectionSlots == 0 ) {
+		freeState( state );
+		return JAVELIN_ERROR_MEMORY;
+	}
+	memset( state->connectionSlots, 0, sizeof (struct JavelinConnection) * state->connectionLimit );
+	for ( javelin_u32 i = 0; i < state->connectionLimit; i++ ) {
+		state->connectionSlots[i].state = state;
+		state->connectionSlots[i].slot = i;
+	}
+	if ( !addressTableCreate( &state->connectionTable, state->connectionLimit, randomGenerator() ) || !addressTableCreate( &state->pendingConnectionTable, JAVELIN_MAX_PENDING_CONNECTIONS, randomGenerator() ) ) {
+		freeState( state );
+		return JAVELIN_ERROR_MEMORY;
+	}
+	state->timerHeap = (struct JavelinTimer*)malloc( sizeof (struct JavelinTimer) * state->connectionLimit );
+	state->queuedEvents = (struct JavelinEvent*)malloc( sizeof (struct JavelinEvent) * state->connectionLimit );
+	state->shared = (struct JavelinSharedState*)calloc( 1, sizeof (struct JavelinSharedState) + sizeof (struct JavelinConcurrentQueue) * state->connectionLimit );
+	if ( state->timerHeap == NULL || state->queuedEvents == NULL || state->shared == NULL ) {
+		freeState( state );
+		return JAVELIN_ERROR_MEMORY;
+	}
+	atomic_init( &state->shared->ioThreadSleeping, false );
+	atomic_init( &state->shared->concurrentPending, false );
+	for ( javelin_u32 i = 0; i < state->connectionLimit; i++ ) {
+		atomic_init( &state->shared->queues[i].head, NULL );
+		atomic_init( &state->shared->queues[i].count, 0 );
+	}
+	state->randomGenerator = randomGenerator;
+	return JAVELIN_ERROR_OK;
+}
+
+static enum JavelinError startSockets( void )
+{
+#ifdef _WIN32
+	WSADATA wsaData;
+	int wsaResult = WSAStartup( MAKEWORD(1,1), &wsaData );
+	if ( wsaResult != 0 ) {
+		return JAVELIN_ERROR_WINSOCK;
+	}
+	if ( LOBYTE(wsaData.wVersion) != 1 || HIBYTE(wsaData.wVersion) != 1 ) {
+		WSACleanup();
+		return JAVELIN_ERROR_WINSOCK;
+	}
+#endif
+	return JAVELIN_ERROR_OK;
+}
+
+static void closeSocket( const int handle )
+{
+#ifdef _WIN32
+	closesocket( handle );
+#else
+	close( handle );
+#endif
+}
+
+enum JavelinError javelinCreateWithConfig( struct JavelinState* state, const char* address, const javelin_u16 port, const javelin_u32 maxConnections, javelin_u32 (*randomGenerator)( void ), const struct JavelinConfig* config )
+{
+	enum JavelinError result = initializeState( state, maxConnections, randomGenerator, config );
+	if ( result != JAVELIN_ERROR_OK ) {
+		return result;
+	}
+
+	result = startSockets();
+	if ( result != JAVELIN_ERROR_OK ) {
+		freeState( state );
+		return result;
+	}
+
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ( address == NULL ) {
+		hints.ai_flags = AI_PASSIVE;
+	}
+
+	char portString[10];
+	snprintf( portString, sizeof (portString), "%i", port );
+
+	struct addrinfo* addrResults;
+	int aiStatus = getaddrinfo( address, portString, &hints, &addrResults );
+	if ( aiStatus != 0 ) {
+		javelinDestroy( state );
+		return JAVELIN_ERROR_GETADDRINFO;
+	}
+
+	struct addrinfo* addr;
+	for ( addr = addrResults; addr != NULL; addr = addr->ai_next ) {
+		state->socket = socket( addr->ai_family, addr->ai_socktype, addr->ai_protocol );
+		if ( state->socket == -1 ) {
+			continue;
+		}
+
+#ifdef SO_REUSEPORT
+		if ( config->reusePort ) {
+			// Lets the other shards bind the same port, with the kernel spreading peers between them
+			int reusePort = 1;
+			if ( setsockopt( state->socket, SOL_SOCKET, SO_REUSEPORT, &reusePort, sizeof (reusePort) ) != 0 ) {
+				closeSocket( state->socket );
+				continue;
+			}
+		}
+#endif
+
+		int bindResult = bind( state->socket, addr->ai_addr, addr->ai_addrlen );
+		if ( bindResult == -1 ) {
+			closeSocket( state->socket );
+			continue;
+		}
+
+		if ( addr->ai_family == AF_INET ) {
+			memcpy( &state->address, addr->ai_addr, sizeof (struct sockaddr_in) );
+		}
+		else {
+			memcpy( &state->address, addr->ai_addr, sizeof (struct sockaddr_in6) );
+
+			int v6Only = 0;
+			setsockopt( state->socket, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof (v6Only) );
+		}
+
+#ifdef _WIN32
+		DWORD nonBlocking = 1;
+		int nbResult = ioctlsocket( state->socket, FIONBIO, &nonBlocking );
+		if ( nbResult != 0 ) {
+			freeaddrinfo( addrResults );
+			javelinDestroy( state );
+			return JAVELIN_ERROR_WINSOCK;
+		}
+#else
+		fcntl( state->socket, F_SETFL, O_NONBLOCK );
+#endif
+		break;
+	}
+
+	freeaddrinfo( addrResults );
+	if ( addr == NULL ) {
+		state->socket = 0;
+		javelinDestroy( state );
+		return JAVELIN_ERROR_SOCKET;
+	}
+
+	return JAVELIN_ERROR_OK;
+}
+
+void javelinDestroy( struct JavelinState* state )
+{
+	javelinStopThread( state );
+	if ( state->simulator != NULL ) {
+		struct JavelinSimulatedEndpoint* endpoint = findSimulatedEndpoint( state );
+		if ( endpoint != NULL ) {
+			free( endpoint->packets );
+			memset( endpoint, 0, sizeof (struct JavelinSimulatedEndpoint) );
+			state->simulator->endpointCount--;
+		}
+		addressTableRemove( &state->simulator->endpointTable, &state->address );
+		state->simulator = NULL;
+	}
+	if ( state->socket != 0 ) {
+		closeSocket( state->socket );
+	}
+	state->socket = 0;
+	freeState( state );
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+static bool isSaltGood( struct JavelinConnection* connection, javelin_u32 salt )
+{
+	return connection->remoteSalt != 0 && (salt ^ connection->localSalt) == connection->remoteSalt;
+}
+
+static javelin_u32 calculateSalt( struct JavelinConnection* connection )
+{
+	return connection->localSalt ^ connection->remoteSalt;
+}
+
+// Reports which messages after incomingLastIdProcessed have already been received out of order
+static javelin_u32 calculateAckBits( const struct JavelinState* state, const struct JavelinChannel* channel )
+{
+	javelin_u32 ackBits = 0;
+	const javelin_u32 count = channel->incomingMessageCapacity < 32 ? channel->incomingMessageCapacity : 32;
+	for ( javelin_u32 i = 0; i < count; i++ ) {
+		const javelin_u16 id = channel->incomingLastIdProcessed + 1 + i;
+		if ( getMessageBlock( state, channel->incomingMessageBuffer, channel->incomingMessageCapacity, id )->messageId == id ) {
+			ackBits |= (javelin_u32)1 << i;
+		}
+	}
+	return ackBits;
+}
+
+// Acks are included for every channel of ackConnection that has received messages, or none if ackConnection is NULL
+static void writePacketHeader( struct JavelinState* state, enum JavelinPacketType type, javelin_u32 salt, const struct JavelinConnection* ackConnection )
+{
+	javelin_u32 ackChannelMask = 0;
+	if ( ackConnection != NULL ) {
+		for ( javelin_u32 i = 0; i < state->config.channelCount; i++ ) {
+			if ( ackConnection->channels[i].incomingMessageBuffer != NULL ) {
+				ackChannelMask |= 1 << i;
+			}
+		}
+	}
+	state->outgoingPacketSize = 0;
+	writeBufferU8( state->outgoingPacketBuffer, &state->outgoingPacketSize, type );
+	writeBufferU32( state->outgoingPacketBuffer, &state->outgoingPacketSize, salt );
+	writeBufferU8( state->outgoingPacketBuffer, &state->outgoingPacketSize, ackConnection != NULL ? ackConnection->incomingLatestChannel : 0 );
+	writeBufferU16( state->outgoingPacketBuffer, &state->outgoingPacketSize, ackConnection != NULL ? ackConnection->channels[ackConnection->incomingLatestChannel].incomingLatestId : 0 );
+	writeBufferU8( state->outgoingPacketBuffer, &state->outgoingPacketSize, ackChannelMask );
+	for ( javelin_u32 i = 0; i < state->config.channelCount; i++ ) {
+		if ( ackChannelMask & (1 << i) ) {
+			writeBufferU16( state->outgoingPacketBuffer, &state->outgoingPacketSize, ackConnection->channels[i].incomingLastIdProcessed );
+			writeBufferU32( state->outgoingPacketBuffer, &state->outgoingPacketSize, calculateAckBits( state, &ackConnection->channels[i] ) );
+		}
+	}
+}
+
+static bool readPacketHeader( const javelin_u8* buffer, const size_t length, size_t* offset, struct JavelinPacketHeader* header )
+{
+	if ( length < PACKET_HEADER_SIZE ) {
+		return false;
+	}
+	header->type = readBufferU8( buffer, offset );
+	header->salt = readBufferU32( buffer, offset );
+	header->latestChannel = readBufferU8( buffer, offset );
+	header->latestMessageId = readBufferU16( buffer, offset );
+	header->ackChannelMask = readBufferU8( buffer, offset );
+	for ( javelin_u32 i = 0; i < JAVELIN_MAX_CHANNELS; i++ ) {
+		if ( header->ackChannelMask & (1 << i) ) {
+			if ( *offset + PACKET_ACK_SIZE > length ) {
+				return false;
+			}
+			header->ackMessageId[i] = readBufferU16( buffer, offset );
+			header->ackBits[i] = readBufferU32( buffer, offset );
+		}
+	}
+	return true;
+}
+
+static void flushPackets( struct JavelinState* state )
+{
+#if JAVELIN_BATCHED_IO
+	struct mmsghdr messages[JAVELIN_PACKET_BATCH_SIZE];
+	struct iovec vectors[JAVELIN_PACKET_BATCH_SIZE];
+	for ( javelin_u32 i = 0; i < state->outgoingPacketCount; i++ ) {
+		struct JavelinPacket* packet = &state->outgoingPackets[i];
+		vectors[i].iov_base = packet->data;
+		vectors[i].iov_len = packet->size;
+		memset( &messages[i], 0, sizeof (struct mmsghdr) );
+		messages[i].msg_hdr.msg_name = &packet->address;
+		messages[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+		messages[i].msg_hdr.msg_iov = &vectors[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+	javelin_u32 sentCount = 0;
+	while ( sentCount < state->outgoingPacketCount ) {
+		int result = sendmmsg( state->socket, &messages[sentCount], state->outgoingPacketCount - sentCount, 0 );
+		if ( result < 0 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			// TODO: Do we care about this error? Count errors towards a forced disconnect?
+			if ( VERBOSE ) printf( "net: sendmmsg error: %i\n", errno );
+			state->socketErrors++;
+			break;
+		}
+		sentCount += result;
+	}
+	state->outgoingPacketCount = 0;
+	state->outgoingPacketBuffer = state->outgoingPackets[0].data;
+#else
+	(void)state;
+#endif
+}
+
+static void sendPacket( struct JavelinState* state, struct sockaddr_storage* address )
+{
+	state->packetsSent++;
+	state->bytesSent += state->outgoingPacketSize;
+	if ( state->simulator != NULL ) {
+		simulatePacket( state, address );
+		return;
+	}
+#if JAVELIN_BATCHED_IO
+	// The packet was already written into place, so it only needs an address
+	struct JavelinPacket* packet = &state->outgoingPackets[state->outgoingPacketCount++];
+	memcpy( &packet->address, address, sizeof (struct sockaddr_storage) );
+	packet->size = state->outgoingPacketSize;
+	if ( state->outgoingPacketCount == JAVELIN_PACKET_BATCH_SIZE ) {
+		flushPackets( state );
+	}
+	state->outgoingPacketBuffer = state->outgoingPackets[state->outgoingPacketCount].data;
+#else
+	int result = sendto( state->socket, state->outgoingPacketBuffer, state->outgoingPacketSize, 0, (struct sockaddr*)address, sizeof (struct sockaddr_storage) );
+	if ( result < 0 ) {
+		// TODO: Do we care about this error? Count errors towards a forced disconnect?
+		if ( VERBOSE ) printf( "net: sendto error: %i\n", errno );
+		state->socketErrors++;
+	}
+#endif
+}
+
+static void sendConnectionPacket( struct JavelinState* state, struct JavelinConnection* connection, const javelin_u64 currentTimeMs )
+{
+	sendPacket( state, &connection->address );
+	connection->lastSendTime = currentTimeMs;
+	connection->bytesSent += state->outgoingPacketSize;
+	connection->packetsSent++;
+}
+
+// Returns the next received packet, or NULL if there are none waiting. Unless canReceive is set, only packets
+// left from the last batch are returned, so the batch is never overwritten.
+static struct JavelinPacket* receivePacket( struct JavelinState* state, const bool canReceive )
+{
+	if ( state->incomingPacketIndex < state->incomingPacketCount ) {
+		return &state->incomingPackets[state->incomingPacketIndex++];
+	}
+	if ( !canReceive ) {
+		return NULL;
+	}
+	state->incomingPacketIndex = 0;
+	state->incomingPacketCount = 0;
+
+	if ( state->simulator != NULL ) {
+		state->incomingPacketCount = receiveSimulatedPackets( state );
+		if ( state->incomingPacketCount == 0 ) {
+			return NULL;
+		}
+		return &state->incomingPackets[state->incomingPacketIndex++];
+	}
+
+#if JAVELIN_BATCHED_IO
+	struct mmsghdr messages[JAVELIN_PACKET_BATCH_SIZE];
+	struct iovec vectors[JAVELIN_PACKET_BATCH_SIZE];
+	for ( javelin_u32 i = 0; i < JAVELIN_PACKET_BATCH_SIZE; i++ ) {
+		struct JavelinPacket* packet = &state->incomingPackets[i];
+		vectors[i].iov_base = packet->data;
+		vectors[i].iov_len = JAVELIN_MAX_PACKET_SIZE;
+		memset( &messages[i], 0, sizeof (struct mmsghdr) );
+		messages[i].msg_hdr.msg_name = &packet->address;
+		messages[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+		messages[i].msg_hdr.msg_iov = &vectors[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+	int receivedCount = recvmmsg( state->socket, messages, JAVELIN_PACKET_BATCH_SIZE, 0, NULL );
+	if ( receivedCount <= 0 ) {
+		if ( receivedCount == -1 && errno != EAGAIN && errno != EWOULDBLOCK ) {
+			// TODO: Do we care about this error? Count errors towards a forced disconnect?
+			if ( VERBOSE ) printf( "net: recvmmsg error: %i\n", errno );
+			state->socketErrors++;
+		}
+		return NULL;
+	}
+	for ( int i = 0; i < receivedCount; i++ ) {
+		state->incomingPackets[i].size = messages[i].msg_len;
+	}
+	state->incomingPacketCount = receivedCount;
+#else
+	struct JavelinPacket* packet = &state->incomingPackets[0];
+	int fromLength = sizeof (packet->address);
+	int receivedLength = recvfrom( state->socket, packet->data, JAVELIN_MAX_PACKET_SIZE, 0, (struct sockaddr*)&packet->address, (socklen_t*)&fromLength );
+	if ( receivedLength <= 0 ) {
+		if ( receivedLength == -1 && errno != EAGAIN && errno != EWOULDBLOCK ) {
+			// TODO: Do we care about this error? Count errors towards a forced disconnect?
+			if ( VERBOSE ) printf( "net: recvfrom error: %i\n", errno );
+			state->socketErrors++;
+		}
+		return NULL;
+	}
+	packet->size = receivedLength;
+	state->incomingPacketCount = 1;
+#endif
+
+	return &state->incomingPackets[state->incomingPacketIndex++];
+}
+
+static void updateSendRate( struct JavelinConnection* connection )
+{
+	const javelin_u64 roundTripTime = connection->roundTripTime > 0 ? connection->roundTripTime : JAVELIN_DEFAULT_RETRY_TIME_MS;
+	javelin_u64 sendRate = (javelin_u64)connection->congestionWindow * JAVELIN_MAX_PACKET_SIZE * 1000 / roundTripTime;
+	const javelin_u32 maxSendRate = connection->state->config.maxSendRate;
+	if ( maxSendRate != 0 && sendRate > maxSendRate ) {
+		sendRate = maxSendRate;
+	}
+	connection->sendRate = sendRate > UINT32_MAX ? UINT32_MAX : (sendRate > 0 ? (javelin_u32)sendRate : 1);
+}
+
+static void resetSendRate( struct JavelinConnection* connection, const javelin_u64 currentTimeMs )
+{
+	connection->congestionWindow = JAVELIN_INITIAL_CONGESTION_WINDOW;
+	connection->congestionThreshold = JAVELIN_MAX_CONGESTION_WINDOW;
+	connection->congestionChangeTime = currentTimeMs;
+	updateSendRate( connection );
+	connection->sendAllowance = JAVELIN_MAX_PACKET_SIZE;
+	connection->sendAllowanceTime = currentTimeMs;
+}
+
+static void refillSendAllowance( struct JavelinConnection* connection, const javelin_u64 currentTimeMs )
+{
+	const javelin_s64 added = (javelin_s64)((currentTimeMs - connection->sendAllowanceTime) * connection->sendRate / 1000);
+	if ( added == 0 ) {
+		return;
+	}
+	javelin_s64 burst = (javelin_s64)connection->sendRate * JAVELIN_SEND_BURST_MS / 1000;
+	if ( burst < JAVELIN_MAX_PACKET_SIZE ) {
+		burst = JAVELIN_MAX_PACKET_SIZE;
+	}
+	connection->sendAllowance += added;
+	if ( connection->sendAllowance > burst ) {
+		connection->sendAllowance = burst;
+	}
+	connection->sendAllowanceTime = currentTimeMs;
+}
+
+// Time at which a throttled connection has allowance to send again
+static javelin_u64 sendAllowanceReadyTime( const struct JavelinConnection* connection )
+{
+	if ( connection->sendAllowance > 0 ) {
+		return connection->sendAllowanceTime;
+	}
+	const javelin_u64 needed = (javelin_u64)(1 - connection->sendAllowance);
+	return connection->sendAllowanceTime + (needed * 1000 + connection->sendRate - 1) / connection->sendRate;
+}
+
+enum JavelinError javelinCreateSimulator( struct JavelinSimulator* simulator, const javelin_u32 maxEndpoints, const javelin_u64 seed, const struct JavelinLinkConditions* conditions )
+{
+	memset( simulator, 0, sizeof (struct JavelinSimulator) );
+	if ( maxEndpoints == 0 || maxEndpoints > INT32_MAX / 2 ) {
+		return JAVELIN_ERROR_INVALID_CONFIG;
+	}
+	simulator->endpoints = (struct JavelinSimulatedEndpoint*)calloc( maxEndpoints, sizeof (struct JavelinSimulatedEndpoint) );
+	if ( simulator->endpoints == NULL ) {
+		return JAVELIN_ERROR_MEMORY;
+	}
+	if ( !addressTableCreate( &simulator->endpointTable, maxEndpoints, (javelin_u32)seed ) ) {
+		free( simulator->endpoints );
+		simulator->endpoints = NULL;
+		return JAVELIN_ERROR_MEMORY;
+	}
+	simulator->endpointLimit = maxEndpoints;
+	// Well clear of zero, which some timestamps use to mean "never"
+	simulator->time = 1000000;
+	simulator->randomState = seed != 0 ? seed : 0x9e3779b97f4a7c15ull;
+	simulator->nextPort = 50000;
+	if ( conditions != NULL ) {
+		simulator->conditions = *conditions;
+	}
+	return JAVELIN_ERROR_OK;
+}
+
+// Destroy the simulated states first
+void javelinDestroySimulator( struct JavelinSimulator* simulator )
+{
+	for ( javelin_u32 i = 0; i < simulator->endpointLimit; i++ ) {
+		free( simulator->endpoints[i].packets );
+	}
+	free( simulator->endpoints );
+	simulator->endpoints = NULL;
+	addressTableDestroy( &simulator->endpointTable );
+}
+
+// Like javelinCreateWithConfig, but the state sends and receives through the simulator rather than a socket,
+// and reads the simulator's clock. The address must be numeric, defaulting to 127.0.0.1, and a port of 0 picks an unused one.
+enum JavelinError javelinCreateSimulated( struct JavelinState* state, struct JavelinSimulator* simulator, const char* address, const javelin_u16 port, const javelin_u32 maxConnections, javelin_u32 (*randomGenerator)( void ), const struct JavelinConfig* config )
+{
+	if ( simulator->endpointCount == simulator->endpointLimit ) {
+		return JAVELIN_ERROR_CONNECTION_LIMIT;
+	}
+
+	enum JavelinError result = initializeState( state, maxConnections, randomGenerator, config );
+	if ( result != JAVELIN_ERROR_OK ) {
+		return result;
+	}
+	result = startSockets();
+	if ( result != JAVELIN_ERROR_OK ) {
+		freeState( state );
+		return result;
+	}
+
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	struct addrinfo* addr;
+	if ( getaddrinfo( address != NULL ? address : "127.0.0.1", NULL, &hints, &addr ) != 0 || addr == NULL ) {
+		javelinDestroy( state );
+		return JAVELIN_ERROR_GETADDRINFO;
+	}
+	memcpy( &state->address, addr->ai_addr, addr->ai_family == AF_INET ? sizeof (struct sockaddr_in) : sizeof (struct sockaddr_in6) );
+	freeaddrinfo( addr );
+
+	javelin_u16 boundPort = port;
+	do {
+		if ( port == 0 ) {
+			boundPort = simulator->nextPort++;
+		}
+		if ( state->address.ss_family == AF_INET ) {
+			((struct sockaddr_in*)&state->address)->sin_port = htons( boundPort );
+		}
+		else {
+			((struct sockaddr_in6*)&state->address)->sin6_port = htons( boundPort );
+		}
+	} while ( port == 0 && addressTableFind( &simulator->endpointTable, &state->address ) >= 0 );
+	if ( addressTableFind( &simulator->endpointTable, &state->address ) >= 0 ) {
+		javelinDestroy( state );
+		return JAVELIN_ERROR_INVALID_ADDRESS;
+	}
+
+	javelin_u32 index = 0;
+	while ( simulator->endpoints[index].state != NULL ) {
+		index++;
+	}
+	simulator->endpoints[index].state = state;
+	simulator->endpointCount++;
+	addressTableInsert( &simulator->endpointTable, &state->address, index );
+
+	state->simulator = simulator;
+	state->config.clock = simulatorClock;
+	state->config.clockContext = simulator;
+	return JAVELIN_ERROR_OK;
+}
+
+// Moves simulated time forward. Packets that have arrived by then are read by the next javelinUpdate() or javelinPollEvents().
+void javelinAdvanceSimulator( struct JavelinSimulator* simulator, const javelin_u32 ms )
+{
+	simulator->time += ms;
+}
+
+// Creates shardCount server states bound to the same port, each with its own socket and connection slots.
+// Each shard is then updated and polled on its own, typically by its own thread.
+enum JavelinError javelinCreateShards( struct JavelinState* shards, const javelin_u32 shardCount, const char* address, const javelin_u16 port, const javelin_u32 maxConnectionsPerShard, javelin_u32 (*randomGenerator)( void ), const struct JavelinConfig* config )
+{
+	if ( shardCount == 0 || shardCount > UINT16_MAX + 1 ) {
+		return JAVELIN_ERROR_INVALID_CONFIG;
+	}
+	if ( port == 0 ) {
+		// Each shard would be given a different port
+		return JAVELIN_ERROR_INVALID_ADDRESS;
+	}
+	struct JavelinConfig shardConfig = *config;
+	shardConfig.reusePort = true;
+	for ( javelin_u32 i = 0; i < shardCount; i++ ) {
+		enum JavelinError result = javelinCreateWithConfig( &shards[i], address, port, maxConnectionsPerShard, randomGenerator, &shardConfig );
+		if ( result != JAVELIN_ERROR_OK ) {
+			javelinDestroyShards( shards, i );
+			return result;
+		}
+		shards[i].shardIndex = (javelin_u16)i;
+	}
+	return JAVELIN_ERROR_OK;
+}
+
+void javelinDestroyShards( struct JavelinState* shards, const javelin_u32 shardCount )
+{
+	for ( javelin_u32 i = 0; i < shardCount; i++ ) {
+		javelinDestroy( &shards[i] );
+	}
+}
+
+// Returns a handle that identifies the connection across shards, and never matches a later connection in the same slot
+javelin_u64 javelinGetConnectionHandle( const struct JavelinConnection* connection )
+{
+	return ((javelin_u64)connection->state->shardIndex << 48) | ((javelin_u64)connection->generation << 32) | (javelin_u32)connection->slot;
+}
+
+// Returns the connection a handle was taken from, or NULL if it has since disconnected. It reads the shard's connection
+// slots, so only call it on the thread running that shard. Other threads send with javelinQueueMessageConcurrent().
+struct JavelinConnection* javelinFindConnection( struct JavelinState* shards, const javelin_u32 shardCount, const javelin_u64 handle )
+{
+	const javelin_u32 shardIndex = (javelin_u32)(handle >> 48);
+	const javelin_u16 generation = (javelin_u16)(handle >> 32);
+	const javelin_u32 slot = (javelin_u32)handle;
+	if ( shardIndex >= shardCount || slot >= shards[shardIndex].connectionLimit ) {
+		return NULL;
+	}
+	struct JavelinConnection* connection = &shards[shardIndex].connectionSlots[slot];
+	if ( !connection->isActive || connection->generation != generation ) {
+		return NULL;
+	}
+	return connection;
+}
+
+enum JavelinError javelinConnect( struct JavelinState* state, const char* address, const javelin_u16 port )
+{
+	if ( address == NULL || port == 0 ) {
+		return JAVELIN_ERROR_INVALID_ADDRESS;
+	}
+	if ( state->ioThread != NULL ) {
+		// Connect before starting the thread
+		return JAVELIN_ERROR_THREAD;
+	}
+
+	struct JavelinConnection* connection = NULL;
+	for ( size_t i = 0; i < state->connectionLimit; i++ ) {
+		if ( state->connectionSlots[i].isActive ) {
+			continue;
+		}
+		connection = &state->connectionSlots[i];
+		resetConnectionSlot( connection );
+		break;
+	}
+	if ( connection == NULL ) {
+		return JAVELIN_ERROR_CONNECTION_LIMIT;
+	}
+
+	char portString[10];
+	snprintf( portString, sizeof (portString), "%i", port );
+
+	struct addrinfo hints = {0};
+	hints.ai_family = state->address.ss_family;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	struct addrinfo* addr;
+	int aiStatus = getaddrinfo( address, portString, &hints, &addr );
+	if ( aiStatus != 0 || addr == NULL ) {
+		return JAVELIN_ERROR_GETADDRINFO;
+	}
+
+	if ( addr->ai_family == AF_INET ) {
+		memcpy( &connection->address, addr->ai_addr, sizeof (struct sockaddr_in) );
+	}
+	else {
+		memcpy( &connection->address, addr->ai_addr, sizeof (struct sockaddr_in6) );
+	}
+
+	javelin_u64 currentTimeMs = getCurrentTime( state );
+
+	connection->isActive = true;
+	addressTableInsert( &state->connectionTable, &connection->address, connection->slot );
+	connection->connectionState = JAVELIN_CONNECTIONSTATE_CONNECTING;
+	connection->retryTime = JAVELIN_DEFAULT_RETRY_TIME_MS;
+	connection->localSalt = state->randomGenerator();
+	resetSendRate( connection, currentTimeMs );
+	if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_REQUEST\n" );
+	writePacketHeader( state, JAVELIN_PACKET_CONNECT_REQUEST, connection->localSalt, NULL );
+	sendConnectionPacket( state, connection, currentTimeMs );
+	flushPackets( state );
+	connection->lastReceiveTime = currentTimeMs;
+	scheduleConnection( state, connection, currentTimeMs + connection->retryTime );
+
+	freeaddrinfo( addr );
+	return JAVELIN_ERROR_OK;
+}
+
+static void disconnectState( struct JavelinState* state )
+{
+	// TODO: Consider whether we need to use this on the server side to disconnect all clients
+	struct JavelinConnection* connection = NULL;
+	for ( size_t i = 0; i < state->connectionLimit; i++ ) {
+		if ( !state->connectionSlots[i].isActive ) {
+			continue;
+		}
+		connection = &state->connectionSlots[i];
+		break;
+	}
+	if ( connection == NULL ) {
+		return;
+	}
+	connection->connectionState = JAVELIN_CONNECTIONSTATE_DISCONNECTING;
+	// TODO: decide when we're fully disconnected
+	if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_DISCONNECT\n" );
+	writePacketHeader( state, JAVELIN_PACKET_DISCONNECT, calculateSalt( connection ), NULL );
+	sendConnectionPacket( state, connection, getCurrentTime( state ) );
+	flushPackets( state );
+}
+
+void javelinDisconnect( struct JavelinState* state )
+{
+	if ( state->ioThread != NULL ) {
+		pushThreadCommand( state, THREAD_COMMAND_DISCONNECT, NULL, NULL, 0, NULL, 0 );
+		return;
+	}
+	disconnectState( state );
+}
+
+static bool idIsGreater( const javelin_u32 first, javelin_u32 second )
+{
+	return ((first > second) && (first - second <= (1 << 15))) ||
+			((first < second) && (second - first > (1 << 15)));
+}
+
+static void updateRetryTime( struct JavelinConnection* connection )
+{
+	javelin_u32 retryTime = connection->roundTripTime > 0 ? connection->roundTripTime + (connection->roundTripTimeVariance > 0 ? 4 * connection->roundTripTimeVariance : 1) : JAVELIN_DEFAULT_RETRY_TIME_MS;
+	for ( javelin_u32 i = 0; i < connection->retryBackoff && retryTime < JAVELIN_MAX_RETRY_TIME_MS; i++ ) {
+		retryTime *= 2;
+	}
+	if ( retryTime < JAVELIN_MIN_RETRY_TIME_MS ) {
+		retryTime = JAVELIN_MIN_RETRY_TIME_MS;
+	}
+	if ( retryTime > JAVELIN_MAX_RETRY_TIME_MS ) {
+		retryTime = JAVELIN_MAX_RETRY_TIME_MS;
+	}
+	connection->retryTime = retryTime;
+}
+
+static void writeMessageHeader( struct JavelinState* state, const javelin_u16 id, const enum JavelinMessageKind kind, const javelin_u32 channel, const size_t size )
+{
+	writeBufferU16( state->outgoingPacketBuffer, &state->outgoingPacketSize, id );
+	writeBufferU16( state->outgoingPacketBuffer, &state->outgoingPacketSize, (kind << MESSAGE_KIND_SHIFT) | (channel << MESSAGE_CHANNEL_SHIFT) | size );
+}
+
+static bool hasUnacknowledgedMessages( const struct JavelinConnection* connection )
+{
+	for ( javelin_u32 i = 0; i < connection->state->config.channelCount; i++ ) {
+		if ( connection->channels[i].outgoingLastIdSent != connection->channels[i].outgoingLastIdAcknowledged ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Advances to the next unacknowledged message, moving through the channels until channelIndex reaches config.channelCount
+static void nextOutgoingMessage( const struct JavelinConnection* connection, javelin_u32* channelIndex, javelin_u16* messageId )
+{
+	const javelin_u32 channelCount = connection->state->config.channelCount;
+	while ( *channelIndex < channelCount && ++*messageId == (javelin_u16)(connection->channels[*channelIndex].outgoingLastIdSent + 1) ) {
+		if ( ++*channelIndex < channelCount ) {
+			*messageId = connection->channels[*channelIndex].outgoingLastIdAcknowledged;
+		}
+	}
+}
+
+// Sends new messages and resends those due before the next flush, packing as many as fit into each DATA packet
+static void sendConnectionData( struct JavelinState* state, struct JavelinConnection* connection, const javelin_u64 currentTimeMs )
+{
+	refillSendAllowance( connection, currentTimeMs );
+	connection->outgoingQueued = false;
+	connection->outgoingFlushTime = currentTimeMs;
+
+	javelin_u64 oldestSendTime = UINT64_MAX;
+	bool messageResent = false;
+	bool oldestMessageResent = false;
+	// Channels are visited in order, so lower numbered channels get first use of the allowance
+	const javelin_u32 channelCount = state->config.channelCount;
+	javelin_u32 channelIndex = 0;
+	javelin_u16 messageId = connection->channels[0].outgoingLastIdAcknowledged;
+	nextOutgoingMessage( connection, &channelIndex, &messageId );
+	javelin_u32 unreliableIndex = 0;
+	while ( (channelIndex < channelCount || unreliableIndex < connection->outgoingUnreliableCount) && connection->sendAllowance > 0 && state->packetBudgetLeft > 0 ) {
+		writePacketHeader( state, JAVELIN_PACKET_DATA, calculateSalt( connection ), connection );
+		bool messagesToSend = false;
+		while ( channelIndex < channelCount ) {
+			struct JavelinChannel* channel = &connection->channels[channelIndex];
+			struct JavelinMessageBlock* block = getMessageBlock( state, channel->outgoingMessageBuffer, channel->outgoingMessageCapacity, messageId );
+			const size_t messageSize = block->fragmentCount > 0 ? FRAGMENT_HEADER_SIZE + block->size : block->size;
+			if ( state->outgoingPacketSize + sizeof (javelin_u16) + sizeof (javelin_u16) + messageSize > JAVELIN_MAX_PACKET_SIZE ) {
+				break;
+			}
+			if ( !block->outgoingAcknowledged && (block->outgoingLastSendTime == 0 || (currentTimeMs + state->config.flushInterval - block->outgoingLastSendTime) > connection->retryTime) ) {
+				if ( VERBOSE ) printf( "net: queuing message to send: channel = %u, id = %i, size = %zu\n", channelIndex, block->messageId, block->size );
+				const javelin_u8* payload = block->sharedMessage != NULL ? block->sharedMessage->payload : block->payload;
+				if ( block->fragmentCount > 0 ) {
+					writeMessageHeader( state, block->messageId, MESSAGE_KIND_FRAGMENT, channelIndex, messageSize );
+					writeBufferU16( state->outgoingPacketBuffer, &state->outgoingPacketSize, block->fragmentIndex );
+					writeBufferU16( state->outgoingPacketBuffer, &state->outgoingPacketSize, block->fragmentCount );
+					payload += (size_t)block->fragmentIndex * JAVELIN_FRAGMENT_SIZE;
+				}
+				else {
+					writeMessageHeader( state, block->messageId, MESSAGE_KIND_RELIABLE, channelIndex, messageSize );
+				}
+				memcpy( &state->outgoingPacketBuffer[state->outgoingPacketSize], payload, block->size );
+				state->outgoingPacketSize += block->size;
+				if ( block->outgoingSendCount > 0 ) {
+					connection->messagesResent++;
+					messageResent = true;
+					oldestMessageResent |= messageId == (javelin_u16)(channel->outgoingLastIdAcknowledged + 1);
+				}
+#if JAVELIN_TRACE
+				if ( block->outgoingSendCount > 0 ) {
+					addHistogramSample( &connection->latency.resend, currentTimeMs - block->outgoingLastSendTime );
+					traceMessage( state, connection, JAVELIN_TRACE_RESENT, channelIndex, messageId, currentTimeMs );
+				}
+				else {
+					addHistogramSample( &connection->latency.queue, currentTimeMs - block->traceTime );
+					traceMessage( state, connection, JAVELIN_TRACE_SENT, channelIndex, messageId, currentTimeMs );
+				}
+#endif
+				block->outgoingLastSendTime = currentTimeMs;
+				block->outgoingSendCount++;
+				messagesToSend = true;
+			}
+			if ( !block->outgoingAcknowledged && block->outgoingLastSendTime < oldestSendTime ) {
+				oldestSendTime = block->outgoingLastSendTime;
+			}
+			nextOutgoingMessage( connection, &channelIndex, &messageId );
+		}
+		// Unreliable messages fill whatever space the reliable ones leave
+		while ( channelIndex == channelCount && unreliableIndex < connection->outgoingUnreliableCount ) {
+			const struct JavelinMessageBlock* block = getMessageBlock( state, connection->outgoingUnreliableBuffer, state->config.maxUnreliableMessages, unreliableIndex );
+			if ( state->outgoingPacketSize + sizeof (javelin_u16) + sizeof (javelin_u16) + block->size > JAVELIN_MAX_PACKET_SIZE ) {
+				break;
+			}
+			if ( VERBOSE ) printf( "net: queuing unreliable message to send: channel = %u, sequence = %u, size = %zu\n", block->channel, block->messageId & 0xffff, block->size );
+			writeMessageHeader( state, block->messageId & 0xffff, block->messageId >> 16, block->channel, block->size );
+			memcpy( &state->outgoingPacketBuffer[state->outgoingPacketSize], block->payload, block->size );
+			state->outgoingPacketSize += block->size;
+			unreliableIndex++;
+			messagesToSend = true;
+		}
+		if ( messagesToSend ) {
+			if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_DATA\n" );
+			connection->sendAllowance -= state->outgoingPacketSize;
+			state->packetBudgetLeft--;
+			sendConnectionPacket( state, connection, currentTimeMs );
+			connection->incomingAckTime = 0;
+		}
+	}
+	connection->outgoingThrottled = channelIndex < channelCount || unreliableIndex < connection->outgoingUnreliableCount;
+	connection->outgoingOldestSendTime = oldestSendTime;
+
+	// Unreliable messages are dropped once sent, anything left over waits for more allowance
+	if ( unreliableIndex > 0 ) {
+		connection->outgoingUnreliableCount -= unreliableIndex;
+		memmove( connection->outgoingUnreliableBuffer, &connection->outgoingUnreliableBuffer[unreliableIndex * state->messageStride], connection->outgoingUnreliableCount * state->messageStride );
+	}
+
+	// A resend means something was lost, so shrink the window, at most once per round trip
+	if ( messageResent && currentTimeMs - connection->congestionChangeTime >= connection->retryTime ) {
+		connection->congestionThreshold = connection->congestionWindow / 2 > JAVELIN_MIN_CONGESTION_WINDOW ? connection->congestionWindow / 2 : JAVELIN_MIN_CONGESTION_WINDOW;
+		connection->congestionWindow = connection->congestionThreshold;
+		connection->congestionChangeTime = currentTimeMs;
+		updateSendRate( connection );
+		if ( VERBOSE ) printf( "net: loss detected, congestion window now %u\n", connection->congestionWindow );
+	}
+
+	// Back off while the oldest message keeps going unacknowledged
+	if ( oldestMessageResent && connection->retryTime < JAVELIN_MAX_RETRY_TIME_MS ) {
+		connection->retryBackoff++;
+		updateRetryTime( connection );
+		if ( VERBOSE ) printf( "net: resent oldest message, retry time now %u\n", connection->retryTime );
+	}
+}
+
+// A ping carries acks for reliable messages that outgoing DATA didn't pick up within JAVELIN_ACK_DELAY_MS,
+// and otherwise is only sent to keep an idle connection alive
+static javelin_u64 nextPingTime( const struct JavelinConnection* connection )
+{
+	const javelin_u64 keepaliveTime = connection->lastSendTime + connection->state->config.keepaliveInterval;
+	if ( connection->incomingAckTime != 0 && connection->incomingAckTime + JAVELIN_ACK_DELAY_MS < keepaliveTime ) {
+		return connection->incomingAckTime + JAVELIN_ACK_DELAY_MS;
+	}
+	return keepaliveTime;
+}
+
+// Sends any DATA, handshake or ping packets that are due for a connection
+static void updateConnection( struct JavelinState* state, struct JavelinConnection* connection, const javelin_u64 currentTimeMs )
+{
+	if ( (hasUnacknowledgedMessages( connection ) || connection->outgoingUnreliableCount > 0) && currentTimeMs >= connection->outgoingFlushTime + state->config.flushInterval ) {
+		sendConnectionData( state, connection, currentTimeMs );
+	}
+
+	if ( connection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTING ) {
+		if ( currentTimeMs - connection->lastSendTime < connection->retryTime ) {
+			return;
+		}
+		if ( connection->remoteSalt == 0 ) {
+			if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_REQUEST\n" );
+			writePacketHeader( state, JAVELIN_PACKET_CONNECT_REQUEST, connection->localSalt, NULL );
+			sendConnectionPacket( state, connection, currentTimeMs );
+		}
+		else {
+			if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE\n" );
+			writePacketHeader( state, JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE, calculateSalt( connection ), NULL );
+			sendConnectionPacket( state, connection, currentTimeMs );
+		}
+	}
+	else if ( connection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTED ) {
+		if ( currentTimeMs < nextPingTime( connection ) ) {
+			return;
+		}
+		if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_PING\n" );
+		writePacketHeader( state, JAVELIN_PACKET_PING, calculateSalt( connection ), connection );
+		sendConnectionPacket( state, connection, currentTimeMs );
+		connection->incomingAckTime = 0;
+	}
+}
+
+// Returns the earliest time at which updateConnection() or a timeout has work to do for a connection
+static javelin_u64 nextConnectionTime( const struct JavelinConnection* connection )
+{
+	javelin_u64 time = connection->lastReceiveTime + JAVELIN_CONNECTION_TIMEOUT_MS;
+	if ( connection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTING && connection->lastSendTime + connection->retryTime < time ) {
+		time = connection->lastSendTime + connection->retryTime;
+	}
+	if ( connection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTED && nextPingTime( connection ) < time ) {
+		time = nextPingTime( connection );
+	}
+	const bool reliablePending = hasUnacknowledgedMessages( connection );
+	javelin_u64 sendTime = UINT64_MAX;
+	if ( connection->outgoingThrottled && (reliablePending || connection->outgoingUnreliableCount > 0) ) {
+		// A throttled pass did not look at every message, so wait for allowance instead
+		sendTime = sendAllowanceReadyTime( connection );
+	}
+	else if ( connection->outgoingQueued ) {
+		sendTime = 0;
+	}
+	else if ( reliablePending ) {
+		sendTime = connection->outgoingOldestSendTime + connection->retryTime + 1;
+	}
+	// Sends wait for the next flush, which picks up everything due by then
+	if ( sendTime != UINT64_MAX && sendTime < connection->outgoingFlushTime + connection->state->config.flushInterval ) {
+		sendTime = connection->outgoingFlushTime + connection->state->config.flushInterval;
+	}
+	if ( sendTime < time ) {
+		time = sendTime;
+	}
+	return time;
+}
+
+static void updateRoundTripTime( struct JavelinConnection* connection, const javelin_u32 sample )
+{
+	// Smoothed round trip time and mean deviation as in RFC 6298
+	if ( connection->roundTripTime == 0 ) {
+		connection->roundTripTime = sample > 0 ? sample : 1;
+		connection->roundTripTimeVariance = sample / 2;
+	}
+	else {
+		const javelin_u32 error = sample > connection->roundTripTime ? sample - connection->roundTripTime : connection->roundTripTime - sample;
+		connection->roundTripTimeVariance = (3 * connection->roundTripTimeVariance + error + 2) / 4;
+		connection->roundTripTime = (7 * connection->roundTripTime + sample + 4) / 8;
+	}
+	updateRetryTime( connection );
+	updateSendRate( connection );
+	if ( VERBOSE ) printf( "net: round trip time %u (sample %u, variance %u), retry time %u\n", connection->roundTripTime, sample, connection->roundTripTimeVariance, connection->retryTime );
+}
+
+static void processAcknowledgements( struct JavelinState* state, struct JavelinConnection* connection, const struct JavelinPacketHeader* packetHeader, const javelin_u64 currentTimeMs )
+{
+	const javelin_u32 previousRetryTime = connection->retryTime;
+	const javelin_u32 previousSendRate = connection->sendRate;
+
+	// The newest message the peer has received is reported as soon as it arrives, so unlike the
+	// cumulative ack it is not held back by earlier losses. Only messages sent exactly once give an
+	// unambiguous sample.
+	if ( packetHeader->latestChannel < state->config.channelCount ) {
+		struct JavelinChannel* channel = &connection->channels[packetHeader->latestChannel];
+		const javelin_u16 latestId = packetHeader->latestMessageId;
+		if ( channel->outgoingMessageBuffer != NULL && idIsGreater( latestId, channel->outgoingLastIdSampled ) && !idIsGreater( latestId, channel->outgoingLastIdSent ) ) {
+			const struct JavelinMessageBlock* block = getMessageBlock( state, channel->outgoingMessageBuffer, channel->outgoingMessageCapacity, latestId );
+			if ( block->messageId == latestId && block->outgoingSendCount == 1 ) {
+				updateRoundTripTime( connection, (javelin_u32)(currentTimeMs - block->outgoingLastSendTime) );
+			}
+			channel->outgoingLastIdSampled = latestId;
+		}
+	}
+
+	bool progress = false;
+	for ( javelin_u32 channelIndex = 0; channelIndex < state->config.channelCount; channelIndex++ ) {
+		struct JavelinChannel* channel = &connection->channels[channelIndex];
+		if ( (packetHeader->ackChannelMask & (1 << channelIndex)) == 0 || channel->outgoingMessageBuffer == NULL ) {
+			continue;
+		}
+		const javelin_u16 ackId = packetHeader->ackMessageId[channelIndex];
+		if ( idIsGreater( ackId, channel->outgoingLastIdAcknowledged ) && !idIsGreater( ackId, channel->outgoingLastIdSent ) ) {
+#if JAVELIN_TRACE
+			for ( javelin_u16 id = channel->outgoingLastIdAcknowledged + 1; id != (javelin_u16)(ackId + 1); id++ ) {
+				const struct JavelinMessageBlock* block = getMessageBlock( state, channel->outgoingMessageBuffer, channel->outgoingMessageCapacity, id );
+				if ( !block->outgoingAcknowledged ) {
+					addHistogramSample( &connection->latency.wire, currentTimeMs - block->outgoingLastSendTime );
+					traceMessage( state, connection, JAVELIN_TRACE_ACKNOWLEDGED, channelIndex, id, currentTimeMs );
+				}
+			}
+#endif
+			releaseOutgoingMessages( state, channel, channel->outgoingLastIdAcknowledged + 1, ackId );
+			channel->outgoingLastIdAcknowledged = ackId;
+			if ( VERBOSE ) printf( "net: channel %u acknowledged up to %u\n", channelIndex, channel->outgoingLastIdAcknowledged );
+			progress = true;
+		}
+
+		const javelin_u32 ackBits = packetHeader->ackBits[channelIndex];
+		if ( ackBits != 0 ) {
+			// Selectively acknowledged messages are skipped when resending
+			const javelin_u32 outstandingCount = (javelin_u16)(channel->outgoingLastIdSent - channel->outgoingLastIdAcknowledged);
+			for ( javelin_u32 i = 0; i < 32; i++ ) {
+				const javelin_u16 id = ackId + 1 + i;
+				if ( (ackBits & ((javelin_u32)1 << i)) == 0 || (javelin_u16)(id - channel->outgoingLastIdAcknowledged - 1) >= outstandingCount ) {
+					continue;
+				}
+				struct JavelinMessageBlock* block = getMessageBlock( state, channel->outgoingMessageBuffer, channel->outgoingMessageCapacity, id );
+#if JAVELIN_TRACE
+				if ( !block->outgoingAcknowledged ) {
+					addHistogramSample( &connection->latency.wire, currentTimeMs - block->outgoingLastSendTime );
+					traceMessage( state, connection, JAVELIN_TRACE_ACKNOWLEDGED, channelIndex, id, currentTimeMs );
+				}
+#endif
+				block->outgoingAcknowledged = true;
+			}
+		}
+	}
+
+	if ( progress ) {
+		// The peer is making progress again, so stop backing off
+		if ( connection->retryBackoff > 0 ) {
+			connection->retryBackoff = 0;
+			updateRetryTime( connection );
+		}
+
+		// Open the window once per round trip while it, rather than config.maxSendRate, is the limit on sending
+		const javelin_u32 roundTripTime = connection->roundTripTime > 0 ? connection->roundTripTime : JAVELIN_DEFAULT_RETRY_TIME_MS;
+		const bool windowLimited = state->config.maxSendRate == 0 || connection->sendRate < state->config.maxSendRate;
+		if ( connection->outgoingThrottled && windowLimited && connection->congestionWindow < JAVELIN_MAX_CONGESTION_WINDOW && currentTimeMs - connection->congestionChangeTime >= roundTripTime ) {
+			connection->congestionWindow = connection->congestionWindow < connection->congestionThreshold ? connection->congestionWindow * 2 : connection->congestionWindow + 1;
+			if ( connection->congestionWindow > JAVELIN_MAX_CONGESTION_WINDOW ) {
+				connection->congestionWindow = JAVELIN_MAX_CONGESTION_WINDOW;
+			}
+			connection->congestionChangeTime = currentTimeMs;
+			updateSendRate( connection );
+		}
+	}
+
+	if ( connection->retryTime < previousRetryTime || connection->sendRate > previousSendRate ) {
+		scheduleConnection( state, connection, nextConnectionTime( connection ) );
+	}
+}
+
+// Returns the next unreliable message left in the most recent DATA packet, as a view that stays valid until the next receivePacket()
+static bool nextUnreliableMessage( struct JavelinState* state, struct JavelinEvent* outEvent )
+{
+	const struct JavelinPacket* packet = state->incomingUnreliablePacket;
+	struct JavelinConnection* connection = &state->connectionSlots[state->incomingUnreliableSlot];
+	while ( state->incomingUnreliableOffset + 2 * sizeof (javelin_u16) <= packet->size ) {
+		const javelin_u16 id = readBufferU16( packet->data, &state->incomingUnreliableOffset );
+		const javelin_u16 sizeField = readBufferU16( packet->data, &state->incomingUnreliableOffset );
+		const javelin_u32 size = sizeField & MESSAGE_SIZE_MASK;
+		const enum JavelinMessageKind kind = sizeField >> MESSAGE_KIND_SHIFT;
+		const javelin_u32 channelIndex = (sizeField >> MESSAGE_CHANNEL_SHIFT) & MESSAGE_CHANNEL_MASK;
+		const size_t payloadOffset = state->incomingUnreliableOffset;
+		if ( payloadOffset + size > packet->size ) {
+			break;
+		}
+		state->incomingUnreliableOffset += size;
+		if ( (kind != MESSAGE_KIND_UNRELIABLE && kind != MESSAGE_KIND_SEQUENCED) || size > state->config.maxMessageSize || channelIndex >= state->config.channelCount ) {
+			continue;
+		}
+		struct JavelinChannel* channel = &connection->channels[channelIndex];
+		if ( kind == MESSAGE_KIND_SEQUENCED ) {
+			if ( !idIsGreater( id, channel->incomingUnreliableSequence ) ) {
+				if ( VERBOSE ) printf( "     dropping sequenced message %u (stale)\n", id );
+				continue;
+			}
+			channel->incomingUnreliableSequence = id;
+		}
+		struct JavelinMessageBlock* block = allocateEventMessage( state, NULL );
+		block->messageId = id;
+		block->channel = channelIndex;
+		block->incomingReadOffset = 0;
+		block->size = size;
+		block->incomingData = &packet->data[payloadOffset];
+		outEvent->connection = connection;
+		outEvent->type = JAVELIN_EVENT_DATA;
+		outEvent->message = block;
+		return true;
+	}
+	state->incomingUnreliablePacket = NULL;
+	return false;
+}
+
+// Stores a received fragment, checking it against the fragment size and config.maxLargeMessageSize. Fragment 0 allocates
+// the reassembly buffer for the whole large message, and later fragments are copied straight into it, so only those that
+// arrive before it need a copy of their own. Returns false if the fragment is bad or memory runs out, leaving it
+// unacknowledged so it is resent.
+static bool storeFragment( const struct JavelinState* state, struct JavelinChannel* channel, struct JavelinMessageBlock* block, const javelin_u16 id, const javelin_u8* data, const javelin_u32 size )
+{
+	if ( size < FRAGMENT_HEADER_SIZE ) {
+		return false;
+	}
+	size_t offset = 0;
+	const javelin_u16 fragmentIndex = readBufferU16( data, &offset );
+	const javelin_u16 fragmentCount = readBufferU16( data, &offset );
+	const javelin_u32 fragmentSize = size - FRAGMENT_HEADER_SIZE;
+	const bool lastFragment = fragmentIndex + 1 == fragmentCount;
+	if ( fragmentIndex >= fragmentCount || (javelin_u64)fragmentCount * JAVELIN_FRAGMENT_SIZE >= (javelin_u64)state->config.maxLargeMessageSize + JAVELIN_FRAGMENT_SIZE ) {
+		return false;
+	}
+	if ( fragmentSize == 0 || fragmentSize > JAVELIN_FRAGMENT_SIZE || (!lastFragment && fragmentSize != JAVELIN_FRAGMENT_SIZE) ) {
+		return false;
+	}
+
+	// Fragment 0 is either still waiting in the ring, or delivered and reassembling in the channel
+	javelin_u8* largeBuffer = NULL;
+	if ( fragmentIndex > 0 ) {
+		const javelin_u16 firstId = id - fragmentIndex;
+		const struct JavelinMessageBlock* firstBlock = getMessageBlock( state, channel->incomingMessageBuffer, channel->incomingMessageCapacity, firstId );
+		const javelin_u16 largeFirstId = channel->incomingLastIdProcessed + 1 - channel->incomingLargeSize / JAVELIN_FRAGMENT_SIZE;
+		if ( firstBlock->messageId == firstId && firstBlock->fragmentIndex == 0 && firstBlock->fragmentCount == fragmentCount ) {
+			largeBuffer = (javelin_u8*)firstBlock->incomingData;
+		}
+		else if ( channel->incomingLargeBuffer != NULL && channel->incomingLargeFragmentCount == fragmentCount && largeFirstId == firstId ) {
+			largeBuffer = channel->incomingLargeBuffer;
+		}
+	}
+	javelin_u8* fragmentData = NULL;
+	if ( largeBuffer != NULL ) {
+		memcpy( &largeBuffer[(size_t)fragmentIndex * JAVELIN_FRAGMENT_SIZE], &data[offset], fragmentSize );
+	}
+	else {
+		fragmentData = (javelin_u8*)malloc( fragmentIndex == 0 ? (size_t)fragmentCount * JAVELIN_FRAGMENT_SIZE : fragmentSize );
+		if ( fragmentData == NULL ) {
+			return false;
+		}
+		memcpy( fragmentData, &data[offset], fragmentSize );
+	}
+	block->incomingData = fragmentData;
+	block->fragmentIndex = fragmentIndex;
+	block->fragmentCount = fragmentCount;
+	block->size = fragmentSize;
+	return true;
+}
+
+// Adds a delivered fragment to the channel's reassembly buffer, returning true once the large message is complete
+static bool appendFragment( struct JavelinChannel* channel, struct JavelinMessageBlock* block )
+{
+	if ( block->fragmentIndex == 0 ) {
+		// Fragment 0 brings the buffer, with any fragments that followed it already copied in
+		free( channel->incomingLargeBuffer );
+		channel->incomingLargeBuffer = (javelin_u8*)block->incomingData;
+		block->incomingData = NULL;
+		channel->incomingLargeSize = 0;
+		channel->incomingLargeFragmentCount = block->fragmentCount;
+	}
+	else if ( channel->incomingLargeBuffer != NULL && (block->fragmentCount != channel->incomingLargeFragmentCount || (size_t)block->fragmentIndex * JAVELIN_FRAGMENT_SIZE != channel->incomingLargeSize) ) {
+		if ( VERBOSE ) printf( "     dropping large message (fragment %u of %u out of place)\n", block->fragmentIndex, block->fragmentCount );
+		free( channel->incomingLargeBuffer );
+		channel->incomingLargeBuffer = NULL;
+	}
+
+	bool complete = false;
+	if ( channel->incomingLargeBuffer != NULL ) {
+		// Only fragments that arrived before fragment 0 still hold their own copy
+		if ( block->incomingData != NULL ) {
+			memcpy( &channel->incomingLargeBuffer[channel->incomingLargeSize], block->incomingData, block->size );
+		}
+		channel->incomingLargeSize += block->size;
+		complete = block->fragmentIndex + 1 == block->fragmentCount;
+	}
+	// The slot is consumed, so leave nothing behind that could be mistaken for a stored fragment
+	free( (void*)block->incomingData );
+	block->incomingData = NULL;
+	block->size = 0;
+	block->messageId = INVALID_MESSAGE_ID;
+	return complete;
+}
+
+// Returns the next event from received packets. Once canReceive is false, no more packets are read, so
+// events already returned from them stay valid.
+static bool processNextEvent( struct JavelinState* state, struct JavelinEvent* outEvent, const bool canReceive, const javelin_u64 currentTimeMs )
+{
+	if ( state->queuedEventIndex < state->queuedEventCount ) {
+		*outEvent = state->queuedEvents[state->queuedEventIndex++];
+		if ( state->queuedEventIndex == state->queuedEventCount ) {
+			state->queuedEventIndex = 0;
+			state->queuedEventCount = 0;
+		}
+		return true;
+	}
+
+	// Keep reading packets until we have a message to return
+	while ( true ) {
+		if ( state->incomingUnreliablePacket != NULL && nextUnreliableMessage( state, outEvent ) ) {
+			return true;
+		}
+
+		struct JavelinConnection* lastPacketConnection = &state->connectionSlots[state->incomingLastPacketSlot];
+		for ( javelin_u32 channelIndex = 0; channelIndex < state->config.channelCount; channelIndex++ ) {
+			struct JavelinChannel* channel = &lastPacketConnection->channels[channelIndex];
+			if ( channel->incomingMessageBuffer == NULL ) {
+				continue;
+			}
+			while ( true ) {
+				const javelin_u16 nextId = channel->incomingLastIdProcessed + 1;
+				struct JavelinMessageBlock* block = getMessageBlock( state, channel->incomingMessageBuffer, channel->incomingMessageCapacity, nextId );
+				if ( block->messageId != nextId ) {
+					break;
+				}
+				if ( channel->incomingPollCount != state->pollCount ) {
+					channel->incomingPollCount = state->pollCount;
+					channel->incomingPollFirstId = nextId;
+				}
+				channel->incomingLastIdProcessed = nextId;
+#if JAVELIN_TRACE
+				const javelin_u64 storedTime = block->traceTime;
+#endif
+				if ( block->fragmentCount > 0 ) {
+					// Fragments are consumed silently until the last one completes the large message
+					if ( !appendFragment( channel, block ) ) {
+						continue;
+					}
+					if ( VERBOSE ) printf( "returning large message ending at %u on channel %u, size = %u\n", nextId, channelIndex, channel->incomingLargeSize );
+					block = allocateEventMessage( state, channel->incomingLargeBuffer );
+					block->messageId = nextId;
+					block->channel = channelIndex;
+					block->incomingReadOffset = 0;
+					block->size = channel->incomingLargeSize;
+					block->incomingData = channel->incomingLargeBuffer;
+					channel->incomingLargeBuffer = NULL;
+				}
+				else if ( VERBOSE ) printf( "returning queued message %u on channel %u\n", block->messageId, channelIndex );
+#if JAVELIN_TRACE
+				addHistogramSample( &lastPacketConnection->latency.hold, currentTimeMs - storedTime );
+				traceMessage( state, lastPacketConnection, JAVELIN_TRACE_DELIVERED, channelIndex, nextId, currentTimeMs );
+#endif
+				outEvent->connection = lastPacketConnection;
+				outEvent->type = JAVELIN_EVENT_DATA;
+				outEvent->message = block;
+				return true;
+			}
+		}
+
+		struct JavelinPacket* packet = receivePacket( state, canReceive );
+		if ( packet == NULL ) {
+			return false;
+		}
+#ifdef _WIN32
+		if ( packet->size == 1 ) {
+			continue;	// a wake for the I/O thread
+		}
+#endif
+		state->packetsReceived++;
+		state->bytesReceived += packet->size;
+		struct sockaddr_storage* fromAddress = &packet->address;
+		const javelin_u8* packetBuffer = packet->data;
+		const size_t receivedLength = packet->size;
+		size_t readOffset = 0;
+		struct JavelinPacketHeader packetHeader;
+		if ( !readPacketHeader( packetBuffer, receivedLength, &readOffset, &packetHeader ) ) {
+			continue;	// next packet
+		}
+
+		struct JavelinConnection* packetConnection = NULL;
+		const javelin_s32 packetSlot = addressTableFind( &state->connectionTable, fromAddress );
+		if ( packetSlot >= 0 ) {
+			packetConnection = &state->connectionSlots[packetSlot];
+			state->incomingLastPacketSlot = packetSlot;
+		}
+
+		if ( packetConnection == NULL ) {
+			struct JavelinPendingConnection* pendingConnection = NULL;
+			const javelin_s32 pendingSlot = addressTableFind( &state->pendingConnectionTable, fromAddress );
+			if ( pendingSlot >= 0 ) {
+				pendingConnection = &state->pendingConnectionSlots[pendingSlot];
+			}
+			if ( pendingConnection == NULL ) {
+				if ( state->pendingConnectionCount == JAVELIN_MAX_PENDING_CONNECTIONS ) {
+					if ( VERBOSE ) printf( "net: server full: %i = %i\n", state->pendingConnectionCount, JAVELIN_MAX_PENDING_CONNECTIONS );
+					writePacketHeader( state, JAVELIN_PACKET_SERVER_FULL, packetHeader.salt, NULL );
+					sendPacket( state, fromAddress );
+					state->serverFullReplies++;
+					continue;	// next packet, no room for another connection attempt
+				}
+				if ( VERBOSE ) printf( "net: new pending slot: %i\n", state->pendingConnectionCount );
+				const javelin_u32 pendingIndex = state->pendingConnectionCount++;
+				pendingConnection = &state->pendingConnectionSlots[pendingIndex];
+				memset( pendingConnection, 0, sizeof (struct JavelinPendingConnection) );
+				pendingConnection->address = *fromAddress;
+				addressTableInsert( &state->pendingConnectionTable, &pendingConnection->address, pendingIndex );
+				if ( state->pendingConnectionCount == 1 ) {
+					state->pendingConnectionTimeoutTime = currentTimeMs + JAVELIN_CONNECTION_TIMEOUT_MS;
+				}
+				pendingConnection->connectionState = JAVELIN_CONNECTIONSTATE_NONE;
+				pendingConnection->localSalt = state->randomGenerator();
+			}
+			pendingConnection->lastReceiveTime = currentTimeMs;
+			if ( packetHeader.type == JAVELIN_PACKET_CONNECT_REQUEST ) {
+				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_CONNECT_REQUEST\n" );
+				if ( packetHeader.salt != 0 ) {
+					pendingConnection->remoteSalt = packetHeader.salt;
+					pendingConnection->connectionState = JAVELIN_CONNECTIONSTATE_CONNECTING;
+					if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_CHALLENGE\n" );
+					writePacketHeader( state, JAVELIN_PACKET_CONNECT_CHALLENGE, pendingConnection->remoteSalt, NULL );
+					writeBufferU32( state->outgoingPacketBuffer, &state->outgoingPacketSize, pendingConnection->localSalt );
+					sendPacket( state, &pendingConnection->address );
+					pendingConnection->lastSendTime = currentTimeMs;
+				}
+			}
+			else if ( packetHeader.type == JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE && pendingConnection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTING ) {
+				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE\n" );
+				if ( (packetHeader.salt ^ pendingConnection->remoteSalt) != pendingConnection->localSalt ) {
+					if ( VERBOSE ) printf( "net: bad salt\n" );
+					continue;	// next packet
+				}
+
+				javelin_s32 availableSlot = -1;
+				for ( size_t slot = 0; slot < state->connectionLimit; slot++ ) {
+					struct JavelinConnection* connection = &state->connectionSlots[slot];
+					if ( !connection->isActive ) {
+						availableSlot = slot;
+						break;
+					}
+				}
+				if ( availableSlot == -1 ) {
+					// TODO: send "server full" packet
+					if ( VERBOSE ) printf( "net: server full\n" );
+					removePendingConnection( state, (javelin_u32)(pendingConnection - state->pendingConnectionSlots) );
+					continue;	// next packet
+				}
+				struct JavelinConnection* connection = &state->connectionSlots[availableSlot];
+				resetConnectionSlot( connection );
+				connection->isActive = true;
+				connection->address = pendingConnection->address;
+				addressTableInsert( &state->connectionTable, &connection->address, availableSlot );
+				connection->connectionState = JAVELIN_CONNECTIONSTATE_CONNECTED;
+				connection->localSalt = pendingConnection->localSalt;
+				connection->remoteSalt = pendingConnection->remoteSalt;
+				connection->retryTime = JAVELIN_DEFAULT_RETRY_TIME_MS;
+				// From here on the connection handles any repeated handshake packets, so the pending slot is free
+				removePendingConnection( state, (javelin_u32)(pendingConnection - state->pendingConnectionSlots) );
+
+				if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_ACCEPT\n" );
+				writePacketHeader( state, JAVELIN_PACKET_CONNECT_ACCEPT, calculateSalt( connection ), NULL );
+				connection->lastReceiveTime = currentTimeMs;
+				resetSendRate( connection, currentTimeMs );
+				sendConnectionPacket( state, connection, currentTimeMs );
+				scheduleConnection( state, connection, nextConnectionTime( connection ) );
+
+				outEvent->connection = connection;
+				outEvent->type = JAVELIN_EVENT_CONNECT;
+				return true;
+			}
+
+			continue;	// next packet
+		}
+
+		packetConnection->lastReceiveTime = currentTimeMs;
+		packetConnection->bytesReceived += receivedLength;
+		packetConnection->packetsReceived++;
+		if ( packetConnection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTING ) {
+			if ( packetHeader.type == JAVELIN_PACKET_CONNECT_CHALLENGE ) {
+				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_CONNECT_CHALLENGE\n" );
+				if ( packetHeader.salt == packetConnection->localSalt ) {
+					packetConnection->remoteSalt = readBufferU32( packetBuffer, &readOffset );
+					if ( packetConnection->remoteSalt != 0 ) {
+						if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE\n" );
+						writePacketHeader( state, JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE, calculateSalt( packetConnection ), NULL );
+						sendConnectionPacket( state, packetConnection, currentTimeMs );
+					}
+				}
+			}
+			else if ( packetHeader.type == JAVELIN_PACKET_CONNECT_ACCEPT && isSaltGood( packetConnection, packetHeader.salt ) ) {
+				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_CONNECT_ACCEPT\n" );
+				packetConnection->connectionState = JAVELIN_CONNECTIONSTATE_CONNECTED;
+				processAcknowledgements( state, packetConnection, &packetHeader, currentTimeMs );
+				outEvent->connection = packetConnection;
+				outEvent->type = JAVELIN_EVENT_CONNECT;
+				return true;
+			}
+			else if ( packetHeader.type == JAVELIN_PACKET_CONNECT_REJECT && isSaltGood( packetConnection, packetHeader.salt ) ) {
+				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_CONNECT_REJECT\n" );
+				packetConnection->connectionState = JAVELIN_CONNECTIONSTATE_DISCONNECTED;
+				outEvent->connection = packetConnection;
+				outEvent->type = JAVELIN_EVENT_DISCONNECT;
+				return true;
+			}
+		}
+		else if ( packetConnection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTED && isSaltGood( packetConnection, packetHeader.salt ) ) {
+			// Only once the salt is good, so a spoofed packet can't release or resend messages
+			processAcknowledgements( state, packetConnection, &packetHeader, currentTimeMs );
+			if ( packetHeader.type == JAVELIN_PACKET_DATA ) {
+				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_DATA\n" );
+				const size_t messagesOffset = readOffset;
+				bool unreliableMessages = false;
+				bool reliableMessages = false;
+				// Messages that continue their channel's delivery order are delivered before the next packet is
+				// received, so they can be left in this one rather than copied into the ring
+				javelin_u16 nextInOrderId[JAVELIN_MAX_CHANNELS];
+				for ( javelin_u32 i = 0; i < state->config.channelCount; i++ ) {
+					nextInOrderId[i] = packetConnection->channels[i].incomingLastIdProcessed + 1;
+				}
+				while ( readOffset + 2 * sizeof (javelin_u16) <= receivedLength ) {
+					// message header
+					const javelin_u16 id = readBufferU16( packetBuffer, &readOffset );
+					const javelin_u16 sizeField = readBufferU16( packetBuffer, &readOffset );
+					const javelin_u32 size = sizeField & MESSAGE_SIZE_MASK;
+					const javelin_u32 channelIndex = (sizeField >> MESSAGE_CHANNEL_SHIFT) & MESSAGE_CHANNEL_MASK;
+					if ( VERBOSE ) printf( "     received message: id = %i, size = %i, kind = %i, channel = %u\n", id, size, sizeField >> MESSAGE_KIND_SHIFT, channelIndex );
+					if ( readOffset + size > receivedLength ) {
+						// If reported size is bad, ignore the rest of the packet
+						if ( VERBOSE ) printf( "     reported size %zu larger than %zu, aborting packet\n", readOffset + size, receivedLength );
+						break;
+					}
+					struct JavelinChannel* channel = &packetConnection->channels[channelIndex];
+					const javelin_u16 distance = id - channel->incomingLastIdProcessed;
+					// Slots delivered earlier in this poll still back its events, so they can't be reused until the next one
+					const javelin_u16 firstId = channel->incomingPollCount == state->pollCount ? channel->incomingPollFirstId : channel->incomingLastIdProcessed + 1;
+					const javelin_u32 requiredCapacity = (javelin_u16)(id - firstId) + 1;
+					const enum JavelinMessageKind kind = sizeField >> MESSAGE_KIND_SHIFT;
+					struct JavelinMessageBlock* block = NULL;
+					reliableMessages |= kind != MESSAGE_KIND_UNRELIABLE && kind != MESSAGE_KIND_SEQUENCED;
+					if ( kind == MESSAGE_KIND_UNRELIABLE || kind == MESSAGE_KIND_SEQUENCED ) {
+						// Left in the packet for nextUnreliableMessage() to deliver
+						unreliableMessages = true;
+					}
+					else if ( channelIndex >= state->config.channelCount ) {
+						if ( VERBOSE ) printf( "     ignoring message %u (bad channel)\n", id );
+					}
+					else if ( distance == 0 || distance > state->config.maxMessages ) {
+						if ( VERBOSE ) printf( "     ignoring message %u (too old)\n", id );
+						packetConnection->oldMessages++;
+					}
+					else if ( kind == MESSAGE_KIND_RELIABLE && size > state->config.maxMessageSize ) {
+						if ( VERBOSE ) printf( "     ignoring message %u (size %u too large)\n", id, size );
+					}
+					else if ( requiredCapacity > channel->incomingMessageCapacity && !growMessageBuffer( state, &channel->incomingMessageBuffer, &channel->incomingMessageCapacity, channel->incomingLastIdProcessed + 1, requiredCapacity, true ) ) {
+						if ( VERBOSE ) printf( "     ignoring message %u (no room)\n", id );
+					}
+					else if ( (block = getMessageBlock( state, channel->incomingMessageBuffer, channel->incomingMessageCapacity, id ))->messageId == id ) {
+						if ( VERBOSE ) printf( "     ignoring message %u (duplicate)\n", id );
+						packetConnection->duplicateMessages++;
+					}
+					else if ( kind == MESSAGE_KIND_FRAGMENT && !storeFragment( state, channel, block, id, &packetBuffer[readOffset], size ) ) {
+						if ( VERBOSE ) printf( "     ignoring message %u (bad fragment)\n", id );
+					}
+					else {
+						if ( VERBOSE ) printf( "     storing message %u (to slot %u)\n", id, id & (channel->incomingMessageCapacity - 1) );
+						if ( kind == MESSAGE_KIND_RELIABLE && id == nextInOrderId[channelIndex] ) {
+							block->incomingData = &packetBuffer[readOffset];
+							block->fragmentCount = 0;
+							block->size = size;
+						}
+						else if ( kind == MESSAGE_KIND_RELIABLE ) {
+							block->incomingData = NULL;
+							block->fragmentCount = 0;
+							block->size = size;
+							memcpy( block->payload, &packetBuffer[readOffset], size );
+						}
+						if ( id == nextInOrderId[channelIndex] ) {
+							nextInOrderId[channelIndex]++;
+						}
+						block->messageId = id;
+						block->channel = channelIndex;
+						block->incomingReadOffset = 0;
+#if JAVELIN_TRACE
+						block->traceTime = currentTimeMs;
+						traceMessage( state, packetConnection, JAVELIN_TRACE_STORED, channelIndex, id, currentTimeMs );
+#endif
+						if ( idIsGreater( id, channel->incomingLatestId ) ) {
+							channel->incomingLatestId = id;
+							packetConnection->incomingLatestChannel = channelIndex;
+						}
+					}
+					readOffset += size;
+				}
+				// Only reliable messages are acknowledged, including duplicates, since their first ack may have been lost
+				if ( reliableMessages && packetConnection->incomingAckTime == 0 ) {
+					packetConnection->incomingAckTime = currentTimeMs;
+					scheduleConnection( state, packetConnection, nextConnectionTime( packetConnection ) );
+				}
+				if ( unreliableMessages ) {
+					state->incomingUnreliablePacket = packet;
+					state->incomingUnreliableOffset = messagesOffset;
+					state->incomingUnreliableSlot = packetSlot;
+				}
+			}
+			else if ( packetHeader.type == JAVELIN_PACKET_PING ) {
+				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_PING\n" );
+				// nothing
+			}
+			else if ( packetHeader.type == JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE ) {
+				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_CONNECT_CHALLENGE_RESPONSE\n" );
+				// We think the client is already connected, but they may not have received the accept packet
+				if ( VERBOSE ) printf( "net: Send packet: JAVELIN_PACKET_CONNECT_ACCEPT\n" );
+				writePacketHeader( state, JAVELIN_PACKET_CONNECT_ACCEPT, calculateSalt( packetConnection ), NULL );
+				sendConnectionPacket( state, packetConnection, currentTimeMs );
+			}
+			else if ( packetHeader.type == JAVELIN_PACKET_DISCONNECT ) {
+				if ( VERBOSE ) printf( "net: Received JAVELIN_PACKET_DISCONNECT\n" );
+				deactivateConnection( state, packetConnection );
+				outEvent->connection = packetConnection;
+				outEvent->type = JAVELIN_EVENT_DISCONNECT;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+// Sends any resends, pings and handshake packets that are due, and times out quiet connections.
+// Call once per tick, then drain events with javelinPollEvents().
+// Moves messages queued from other threads into their connections' message rings. Messages for a connection that has
+// gone are dropped, and those that don't fit are held, in order, for the next update.
+static void drainConcurrentMessages( struct JavelinState* state )
+{
+	struct JavelinSharedState* shared = state->shared;
+	if ( !atomic_exchange( &shared->concurrentPending, false ) && !shared->concurrentHeld ) {
+		return;
+	}
+	shared->concurrentHeld = false;
+	for ( javelin_u32 slot = 0; slot < state->connectionLimit; slot++ ) {
+		struct JavelinConcurrentQueue* queue = &shared->queues[slot];
+		struct JavelinConcurrentMessage* message = atomic_exchange_explicit( &queue->head, NULL, memory_order_acquire );
+		// Reverse the stack onto the end of the held list, oldest first
+		struct JavelinConcurrentMessage* taken = NULL;
+		struct JavelinConcurrentMessage* takenTail = message;
+		while ( message != NULL ) {
+			struct JavelinConcurrentMessage* next = message->next;
+			message->next = taken;
+			taken = message;
+			message = next;
+		}
+		if ( taken != NULL ) {
+			if ( queue->held != NULL ) {
+				queue->heldTail->next = taken;
+			}
+			else {
+				queue->held = taken;
+			}
+			queue->heldTail = takenTail;
+		}
+
+		struct JavelinConnection* connection = &state->connectionSlots[slot];
+		while ( queue->held != NULL ) {
+			message = queue->held;
+			if ( connection->isActive && connection->generation == message->generation && queueMessage( connection, &message->block ) == JAVELIN_ERROR_MESSAGE_BUFFER_FULL ) {
+				shared->concurrentHeld = true;
+				break;
+			}
+			queue->held = message->next;
+			free( message );
+			atomic_fetch_sub_explicit( &queue->count, 1, memory_order_relaxed );
+		}
+	}
+}
+
+static void updateState( struct JavelinState* state )
+{
+	const javelin_u64 currentTimeMs = getCurrentTime( state );
+	// Updates within the same millisecond, such as javelinProcess() makes for each event, share one budget
+	if ( currentTimeMs != state->packetBudgetTime ) {
+		state->packetBudgetLeft = state->config.packetBudget > 0 ? state->config.packetBudget : UINT32_MAX;
+		state->packetBudgetTime = currentTimeMs;
+	}
+	drainConcurrentMessages( state );
+
+	// Only connections with a resend, ping or timeout due are visited
+	while ( state->timerCount > 0 && state->timerHeap[0].time <= currentTimeMs ) {
+		struct JavelinConnection* connection = &state->connectionSlots[state->timerHeap[0].slot];
+		if ( currentTimeMs - connection->lastReceiveTime >= JAVELIN_CONNECTION_TIMEOUT_MS ) {
+			if ( VERBOSE ) printf( "connection timeout for slot %zu\n", connection->slot );
+			deactivateConnection( state, connection );
+			if ( state->queuedEventCount < state->connectionLimit ) {
+				state->queuedEvents[state->queuedEventCount++] = (struct JavelinEvent) { .connection = connection, .type = JAVELIN_EVENT_DISCONNECT };
+			}
+			continue;
+		}
+		updateConnection( state, connection, currentTimeMs );
+		// Anything still due was held back by config.packetBudget, so it goes first in the next update
+		const javelin_u64 nextTime = nextConnectionTime( connection );
+		scheduleConnection( state, connection, nextTime > currentTimeMs ? nextTime : currentTimeMs + 1 );
+	}
+
+	// Scan pendingConnections for timeouts
+	if ( state->pendingConnectionCount > 0 && currentTimeMs >= state->pendingConnectionTimeoutTime ) {
+		javelin_u64 nextTimeoutTime = UINT64_MAX;
+		size_t pendingConnectionIndex = 0;
+		while ( pendingConnectionIndex < state->pendingConnectionCount ) {
+			struct JavelinPendingConnection* pendingConnection = &state->pendingConnectionSlots[pendingConnectionIndex];
+			if ( currentTimeMs - pendingConnection->lastReceiveTime >= JAVELIN_CONNECTION_TIMEOUT_MS ) {
+				if ( VERBOSE ) printf( "net: pending connection timeout: %zu\n", pendingConnectionIndex );
+				removePendingConnection( state, pendingConnectionIndex );
+			}
+			else {
+				if ( pendingConnection->lastReceiveTime + JAVELIN_CONNECTION_TIMEOUT_MS < nextTimeoutTime ) {
+					nextTimeoutTime = pendingConnection->lastReceiveTime + JAVELIN_CONNECTION_TIMEOUT_MS;
+				}
+				pendingConnectionIndex++;
+			}
+		}
+		state->pendingConnectionTimeoutTime = nextTimeoutTime;
+	}
+
+	flushPackets( state );
+}
+
+static size_t pollEvents( struct JavelinState* state, struct JavelinEvent* events, const size_t maxEvents )
+{
+	const javelin_u64 currentTimeMs = getCurrentTime( state );
+	const size_t eventLimit = resetEventMessages( state, maxEvents );
+	state->pollCount++;
+	size_t eventCount = 0;
+	while ( eventCount < eventLimit && processNextEvent( state, &events[eventCount], eventCount == 0, currentTimeMs ) ) {
+		eventCount++;
+	}
+	flushPackets( state );
+	return eventCount;
+}
+
+// Runs resends, pings and timeouts, and sends anything queued. Does nothing while the state runs on its own thread.
+void javelinUpdate( struct JavelinState* state )
+{
+	if ( state->ioThread == NULL ) {
+		updateState( state );
+	}
+}
+
+// Fills events with up to maxEvents events, returning how many. It may return fewer before all waiting
+// packets have been read, so call it until it returns zero. Events stay valid until the next call.
+size_t javelinPollEvents( struct JavelinState* state, struct JavelinEvent* events, const size_t maxEvents )
+{
+	if ( state->ioThread != NULL ) {
+		return pollThreadEvents( state, events, maxEvents );
+	}
+	return pollEvents( state, events, maxEvents );
+}
+
+bool javelinProcess( struct JavelinState* state, struct JavelinEvent* outEvent )
+{
+	javelinUpdate( state );
+	return javelinPollEvents( state, outEvent, 1 ) == 1;
+}
+
+int javelinGetSocket( const struct JavelinState* state )
+{
+	return state->socket;
+}
+
+static javelin_u32 countQueuedMessages( const struct JavelinConnection* connection )
+{
+	javelin_u32 queuedCount = 0;
+	for ( javelin_u32 i = 0; i < connection->state->config.channelCount; i++ ) {
+		queuedCount += (javelin_u16)(connection->channels[i].outgoingLastIdSent - connection->channels[i].outgoingLastIdAcknowledged);
+	}
+	return queuedCount;
+}
+
+// Totals for the state, with the per-connection counters summed over its active connections. Like the rest of the
+// state, only read them from the thread that runs it.
+void javelinGetStats( const struct JavelinState* state, struct JavelinStats* outStats )
+{
+	memset( outStats, 0, sizeof (struct JavelinStats) );
+	outStats->packetsSent = state->packetsSent;
+	outStats->packetsReceived = state->packetsReceived;
+	outStats->bytesSent = state->bytesSent;
+	outStats->bytesReceived = state->bytesReceived;
+	outStats->serverFullReplies = state->serverFullReplies;
+	outStats->socketErrors = state->socketErrors;
+	outStats->pendingConnectionCount = state->pendingConnectionCount;
+	for ( size_t i = 0; i < state->connectionLimit; i++ ) {
+		const struct JavelinConnection* connection = &state->connectionSlots[i];
+		if ( !connection->isActive ) {
+			continue;
+		}
+		outStats->messagesResent += connection->messagesResent;
+		outStats->duplicateMessages += connection->duplicateMessages;
+		outStats->oldMessages += connection->oldMessages;
+		outStats->queuedMessages += countQueuedMessages( connection );
+		outStats->connectionCount++;
+	}
+}
+
+void javelinGetConnectionStats( const struct JavelinConnection* connection, struct JavelinStats* outStats )
+{
+	memset( outStats, 0, sizeof (struct JavelinStats) );
+	outStats->packetsSent = connection->packetsSent;
+	outStats->packetsReceived = connection->packetsReceived;
+	outStats->bytesSent = connection->bytesSent;
+	outStats->bytesReceived = connection->bytesReceived;
+	outStats->messagesResent = connection->messagesResent;
+	outStats->duplicateMessages = connection->duplicateMessages;
+	outStats->oldMessages = connection->oldMessages;
+	outStats->queuedMessages = connection->isActive ? countQueuedMessages( connection ) : 0;
+	outStats->roundTripTime = connection->roundTripTime;
+}
+
+// Returns an upper bound in milliseconds on the given fraction of the histogram's samples, such as 0.99 for the
+// 99th percentile, or zero if it is empty
+javelin_u32 javelinGetHistogramPercentile( const struct JavelinHistogram* histogram, const float fraction )
+{
+	const double exactTarget = (double)fraction * histogram->count;
+	javelin_u64 target = (javelin_u64)exactTarget;
+	if ( target < exactTarget ) {
+		target++;
+	}
+	javelin_u64 total = 0;
+	for ( javelin_u32 bucket = 0; bucket < JAVELIN_HISTOGRAM_BUCKETS; bucket++ ) {
+		total += histogram->buckets[bucket];
+		if ( total >= target && total > 0 ) {
+			const javelin_u32 upperBound = bucket == JAVELIN_HISTOGRAM_BUCKETS - 1 ? UINT32_MAX : ((javelin_u32)1 << bucket) - 1;
+			return upperBound < histogram->max ? upperBound : histogram->max;
+		}
+	}
+	return 0;
+}
+
+// Returns how many milliseconds until javelinUpdate next has a resend, ping or timeout to handle,
+// zero if one is already due, or UINT32_MAX if nothing is scheduled
+javelin_u32 javelinGetNextTimeout( const struct JavelinState* state )
+{
+	javelin_u64 deadline = UINT64_MAX;
+	if ( state->timerCount > 0 ) {
+		deadline = state->timerHeap[0].time;
+	}
+	if ( state->pendingConnectionCount > 0 && state->pendingConnectionTimeoutTime < deadline ) {
+		deadline = state->pendingConnectionTimeoutTime;
+	}
+	if ( state->simulator != NULL ) {
+		// The next simulated arrival stands in for the socket becoming readable
+		const struct JavelinSimulatedEndpoint* endpoint = findSimulatedEndpoint( state );
+		if ( endpoint != NULL && endpoint->packetCount > 0 && endpoint->packets[0].deliveryTime < deadline ) {
+			deadline = endpoint->packets[0].deliveryTime;
+		}
+	}
+	if ( deadline == UINT64_MAX ) {
+		return UINT32_MAX;
+	}
+	const javelin_u64 currentTimeMs = getCurrentTime( state );
+	if ( deadline <= currentTimeMs ) {
+		return 0;
+	}
+	return deadline - currentTimeMs < UINT32_MAX ? (javelin_u32)(deadline - currentTimeMs) : UINT32_MAX;
+}
+
+static bool waitForPacket( struct JavelinState* state, const javelin_u32 maxWaitMs )
+{
+	if ( state->queuedEventCount > 0 || state->incomingPacketIndex < state->incomingPacketCount || state->incomingUnreliablePacket != NULL ) {
+		return true;
+	}
+	javelin_u32 waitMs = javelinGetNextTimeout( state );
+	if ( state->simulator != NULL ) {
+		// Simulated time only moves with javelinAdvanceSimulator(), so there is nothing to sleep for
+		const struct JavelinSimulatedEndpoint* endpoint = findSimulatedEndpoint( state );
+		return endpoint != NULL && endpoint->packetCount > 0 && endpoint->packets[0].deliveryTime <= state->simulator->time;
+	}
+	if ( waitMs > maxWaitMs ) {
+		waitMs = maxWaitMs;
+	}
+	if ( waitMs > INT32_MAX ) {
+		waitMs = INT32_MAX;
+	}
+#ifdef _WIN32
+	WSAPOLLFD pollSocket = { .fd = state->socket, .events = POLLRDNORM };
+	const int result = WSAPoll( &pollSocket, 1, (INT)waitMs );
+#else
+	// Only the I/O thread waits here while a state has one, and it is also woken through the pipe
+	struct pollfd pollSockets[2] = { { .fd = state->socket, .events = POLLIN }, { .fd = state->shared->wakePipe[0], .events = POLLIN } };
+	const int result = poll( pollSockets, state->ioThread != NULL ? 2 : 1, (int)waitMs );
+	if ( result > 0 && state->ioThread != NULL && pollSockets[1].revents != 0 ) {
+		char wake[16];
+		while ( read( state->shared->wakePipe[0], wake, sizeof (wake) ) > 0 ) {
+		}
+	}
+#endif
+	if ( result < 0 ) {
+		if ( VERBOSE ) printf( "net: poll error: %i\n", errno );
+		state->socketErrors++;
+		return false;
+	}
+	return result > 0;
+}
+
+// Sleeps until a packet arrives, the next timeout is due, or maxWaitMs passes. Returns true if
+// javelinPollEvents has something to read, false once the time is up.
+bool javelinWait( struct JavelinState* state, const javelin_u32 maxWaitMs )
+{
+	if ( state->ioThread != NULL ) {
+		return waitForThreadEvents( state, maxWaitMs );
+	}
+	return waitForPacket( state, maxWaitMs );
+}
+
+struct JavelinMessageBlock javelinCreateMessage( void )
+{
+	// .size field must be initialized to zero before writing to a message
+	return (struct JavelinMessageBlock) { 0 };
+}
+
+static bool isValidMessage( const struct JavelinState* state, const struct JavelinMessageBlock* block )
+{
+	return block->size > 0 && block->size <= state->config.maxMessageSize && block->channel < state->config.channelCount;
+}
+
+// Finds the ring entry for the next outgoing message on a channel, growing the ring if it is full
+static enum JavelinError reserveOutgoingMessage( struct JavelinConnection* connection, struct JavelinChannel* channel, struct JavelinMessageBlock** outBlock )
+{
+	if ( !connection->isActive ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: connection inactive\n" );
+		return JAVELIN_ERROR_CONNECTION_INACTIVE;
+	}
+
+	struct JavelinState* state = connection->state;
+	const javelin_u32 queuedCount = (javelin_u16)(channel->outgoingLastIdSent - channel->outgoingLastIdAcknowledged);
+	if ( queuedCount >= channel->outgoingMessageCapacity ) {
+		if ( queuedCount >= state->config.maxMessages ) {
+			if ( VERBOSE ) printf( "net: Unable to queue message: buffer full\n" );
+			return JAVELIN_ERROR_MESSAGE_BUFFER_FULL;
+		}
+		if ( !growMessageBuffer( state, &channel->outgoingMessageBuffer, &channel->outgoingMessageCapacity, channel->outgoingLastIdAcknowledged + 1, queuedCount + 1, false ) ) {
+			if ( VERBOSE ) printf( "net: Unable to queue message: out of memory\n" );
+			return JAVELIN_ERROR_MEMORY;
+		}
+	}
+
+	*outBlock = getMessageBlock( state, channel->outgoingMessageBuffer, channel->outgoingMessageCapacity, channel->outgoingLastIdSent + 1 );
+	return JAVELIN_ERROR_OK;
+}
+
+// Makes sure the connection gets a DATA pass at its next flush
+static void scheduleSend( struct JavelinState* state, struct JavelinConnection* connection )
+{
+	if ( !connection->outgoingQueued ) {
+		connection->outgoingQueued = true;
+		if ( connection->timerIndex != 0 ) {
+			scheduleConnection( state, connection, nextConnectionTime( connection ) );
+		}
+	}
+}
+
+// Assigns the reserved ring entry the next outgoing id, so it is sent on the next javelinProcess
+static void commitOutgoingMessage( struct JavelinConnection* connection, struct JavelinChannel* channel, struct JavelinMessageBlock* outgoingBlock )
+{
+	struct JavelinState* state = connection->state;
+	outgoingBlock->messageId = ++channel->outgoingLastIdSent & 0xffff;
+	outgoingBlock->outgoingLastSendTime = 0;
+	outgoingBlock->outgoingSendCount = 0;
+	outgoingBlock->outgoingAcknowledged = false;
+	if ( VERBOSE ) printf( "net: message queued as %i\n", outgoingBlock->messageId );
+#if JAVELIN_TRACE
+	outgoingBlock->traceTime = getCurrentTime( state );
+	traceMessage( state, connection, JAVELIN_TRACE_QUEUED, (javelin_u32)(channel - connection->channels), outgoingBlock->messageId, outgoingBlock->traceTime );
+#endif
+
+	scheduleSend( state, connection );
+}
+
+static enum JavelinError queueMessage( struct JavelinConnection* connection, const struct JavelinMessageBlock* block )
+{
+	if ( connection->isActive && !isValidMessage( connection->state, block ) ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: invalid\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+
+	struct JavelinChannel* channel = &connection->channels[block->channel];
+	struct JavelinMessageBlock* outgoingBlock;
+	enum JavelinError result = reserveOutgoingMessage( connection, channel, &outgoingBlock );
+	if ( result != JAVELIN_ERROR_OK ) {
+		return result;
+	}
+	memcpy( outgoingBlock->payload, block->payload, block->size );
+	outgoingBlock->channel = block->channel;
+	outgoingBlock->size = block->size;
+	outgoingBlock->sharedMessage = NULL;
+	outgoingBlock->fragmentCount = 0;
+	commitOutgoingMessage( connection, channel, outgoingBlock );
+	return JAVELIN_ERROR_OK;
+}
+
+enum JavelinError javelinQueueMessage( struct JavelinConnection* connection, struct JavelinMessageBlock* block )
+{
+	if ( connection->state->ioThread != NULL ) {
+		return pushThreadCommand( connection->state, THREAD_COMMAND_MESSAGE, connection, block, block->channel, NULL, 0 );
+	}
+	return queueMessage( connection, block );
+}
+
+// Queues a reliable message for the connection a handle came from, and may be called from any number of threads at
+// once. The message is moved into the connection's message ring by the next javelinUpdate of its shard, or dropped if
+// the connection has gone by then.
+enum JavelinError javelinQueueMessageConcurrent( struct JavelinState* shards, const javelin_u32 shardCount, const javelin_u64 handle, const struct JavelinMessageBlock* block )
+{
+	const javelin_u32 shardIndex = (javelin_u32)(handle >> 48);
+	const javelin_u16 generation = (javelin_u16)(handle >> 32);
+	const javelin_u32 slot = (javelin_u32)handle;
+	if ( shardIndex >= shardCount || slot >= shards[shardIndex].connectionLimit || generation == 0 ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: invalid connection handle\n" );
+		return JAVELIN_ERROR_CONNECTION_INACTIVE;
+	}
+	struct JavelinState* state = &shards[shardIndex];
+	if ( !isValidMessage( state, block ) ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: invalid\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+	struct JavelinConcurrentQueue* queue = &state->shared->queues[slot];
+	if ( atomic_fetch_add_explicit( &queue->count, 1, memory_order_relaxed ) >= state->config.maxMessages ) {
+		atomic_fetch_sub_explicit( &queue->count, 1, memory_order_relaxed );
+		if ( VERBOSE ) printf( "net: Unable to queue message: buffer full\n" );
+		return JAVELIN_ERROR_MESSAGE_BUFFER_FULL;
+	}
+	struct JavelinConcurrentMessage* message = (struct JavelinConcurrentMessage*)malloc( sizeof (struct JavelinConcurrentMessage) );
+	if ( message == NULL ) {
+		atomic_fetch_sub_explicit( &queue->count, 1, memory_order_relaxed );
+		return JAVELIN_ERROR_MEMORY;
+	}
+	message->generation = generation;
+	message->block.channel = block->channel;
+	message->block.size = block->size;
+	memcpy( message->block.payload, block->payload, block->size );
+
+	message->next = atomic_load_explicit( &queue->head, memory_order_relaxed );
+	while ( !atomic_compare_exchange_weak_explicit( &queue->head, &message->next, message, memory_order_release, memory_order_relaxed ) ) {
+	}
+	atomic_store( &state->shared->concurrentPending, true );
+	notifyIoThread( state );
+	return JAVELIN_ERROR_OK;
+}
+
+// Reserves the next ring entry on a channel, so a message can be written straight into it and then sent with
+// javelinCommitMessage(). Nothing else may be queued on the channel until then, and a message that is never
+// committed is simply dropped.
+enum JavelinError javelinBeginMessage( struct JavelinConnection* connection, const javelin_u32 channelIndex, struct JavelinMessageBlock** outBlock )
+{
+	if ( connection->state->ioThread != NULL ) {
+		return beginThreadMessage( connection, channelIndex, outBlock );
+	}
+	if ( connection->isActive && channelIndex >= connection->state->config.channelCount ) {
+		if ( VERBOSE ) printf( "net: Unable to begin message: invalid channel\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+
+	struct JavelinMessageBlock* block;
+	enum JavelinError result = reserveOutgoingMessage( connection, &connection->channels[channelIndex], &block );
+	if ( result != JAVELIN_ERROR_OK ) {
+		return result;
+	}
+	block->channel = channelIndex;
+	block->size = 0;
+	block->capacity = connection->state->config.maxMessageSize;
+	block->sharedMessage = NULL;
+	block->fragmentCount = 0;
+	*outBlock = block;
+	return JAVELIN_ERROR_OK;
+}
+
+enum JavelinError javelinCommitMessage( struct JavelinConnection* connection, struct JavelinMessageBlock* block )
+{
+	if ( connection->state->ioThread != NULL ) {
+		return commitThreadMessage( connection, block );
+	}
+	if ( !connection->isActive ) {
+		if ( VERBOSE ) printf( "net: Unable to commit message: connection inactive\n" );
+		return JAVELIN_ERROR_CONNECTION_INACTIVE;
+	}
+	struct JavelinState* state = connection->state;
+	if ( !isValidMessage( state, block ) ) {
+		if ( VERBOSE ) printf( "net: Unable to commit message: invalid\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+	struct JavelinChannel* channel = &connection->channels[block->channel];
+	if ( channel->outgoingMessageBuffer == NULL || block != getMessageBlock( state, channel->outgoingMessageBuffer, channel->outgoingMessageCapacity, channel->outgoingLastIdSent + 1 ) ) {
+		if ( VERBOSE ) printf( "net: Unable to commit message: not reserved with javelinBeginMessage\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+	commitOutgoingMessage( connection, channel, block );
+	return JAVELIN_ERROR_OK;
+}
+
+static enum JavelinError queueLargeMessage( struct JavelinConnection* connection, const javelin_u32 channelIndex, const void* data, const size_t size )
+{
+	if ( !connection->isActive ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: connection inactive\n" );
+		return JAVELIN_ERROR_CONNECTION_INACTIVE;
+	}
+	struct JavelinState* state = connection->state;
+	if ( size == 0 || size > state->config.maxLargeMessageSize || channelIndex >= state->config.channelCount ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: invalid\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+	if ( size <= state->config.maxMessageSize ) {
+		struct JavelinMessageBlock block = javelinCreateMessage();
+		block.channel = channelIndex;
+		block.size = size;
+		memcpy( block.payload, data, size );
+		return queueMessage( connection, &block );
+	}
+
+	struct JavelinChannel* channel = &connection->channels[channelIndex];
+	const javelin_u32 fragmentCount = (javelin_u32)((size + JAVELIN_FRAGMENT_SIZE - 1) / JAVELIN_FRAGMENT_SIZE);
+	const javelin_u32 queuedCount = (javelin_u16)(channel->outgoingLastIdSent - channel->outgoingLastIdAcknowledged);
+	if ( queuedCount + fragmentCount > state->config.maxMessages ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: buffer full\n" );
+		return JAVELIN_ERROR_MESSAGE_BUFFER_FULL;
+	}
+	if ( queuedCount + fragmentCount > channel->outgoingMessageCapacity && !growMessageBuffer( state, &channel->outgoingMessageBuffer, &channel->outgoingMessageCapacity, channel->outgoingLastIdAcknowledged + 1, queuedCount + fragmentCount, false ) ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: out of memory\n" );
+		return JAVELIN_ERROR_MEMORY;
+	}
+	struct JavelinSharedMessage* sharedMessage = allocateSharedMessage( state, size );
+	if ( sharedMessage == NULL ) {
+		return JAVELIN_ERROR_MEMORY;
+	}
+	memcpy( sharedMessage->payload, data, size );
+	sharedMessage->referenceCount = fragmentCount;
+
+	for ( javelin_u32 i = 0; i < fragmentCount; i++ ) {
+		struct JavelinMessageBlock* outgoingBlock = getMessageBlock( state, channel->outgoingMessageBuffer, channel->outgoingMessageCapacity, channel->outgoingLastIdSent + 1 );
+		const size_t offset = (size_t)i * JAVELIN_FRAGMENT_SIZE;
+		outgoingBlock->channel = channelIndex;
+		outgoingBlock->size = size - offset < JAVELIN_FRAGMENT_SIZE ? size - offset : JAVELIN_FRAGMENT_SIZE;
+		outgoingBlock->sharedMessage = sharedMessage;
+		outgoingBlock->fragmentIndex = i;
+		outgoingBlock->fragmentCount = fragmentCount;
+		channel->outgoingSharedCount++;
+		commitOutgoingMessage( connection, channel, outgoingBlock );
+	}
+	return JAVELIN_ERROR_OK;
+}
+
+// Splits data into JAVELIN_FRAGMENT_SIZE fragments sent as consecutive reliable messages on one channel, which the
+// peer reassembles and delivers as a single message. Either every fragment is queued or none are.
+enum JavelinError javelinQueueLargeMessage( struct JavelinConnection* connection, const javelin_u32 channelIndex, const void* data, const size_t size )
+{
+	if ( connection->state->ioThread != NULL ) {
+		return pushThreadCommand( connection->state, THREAD_COMMAND_LARGE, connection, NULL, channelIndex, data, size );
+	}
+	return queueLargeMessage( connection, channelIndex, data, size );
+}
+
+// Unreliable messages are sent once, with the next DATA packet, and never resent or acknowledged
+static enum JavelinError queueUnreliableMessage( struct JavelinConnection* connection, const struct JavelinMessageBlock* block, const enum JavelinMessageKind kind )
+{
+	if ( !connection->isActive ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: connection inactive\n" );
+		return JAVELIN_ERROR_CONNECTION_INACTIVE;
+	}
+	struct JavelinState* state = connection->state;
+	if ( !isValidMessage( state, block ) ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: invalid\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+	if ( connection->outgoingUnreliableBuffer == NULL ) {
+		connection->outgoingUnreliableBuffer = allocateMessageBuffer( state, state->config.maxUnreliableMessages );
+		if ( connection->outgoingUnreliableBuffer == NULL ) {
+			if ( VERBOSE ) printf( "net: Unable to queue message: out of memory\n" );
+			return JAVELIN_ERROR_MEMORY;
+		}
+	}
+	if ( connection->outgoingUnreliableCount == state->config.maxUnreliableMessages ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: buffer full\n" );
+		return JAVELIN_ERROR_MESSAGE_BUFFER_FULL;
+	}
+
+	struct JavelinMessageBlock* outgoingBlock = getMessageBlock( state, connection->outgoingUnreliableBuffer, state->config.maxUnreliableMessages, connection->outgoingUnreliableCount++ );
+	// kind in the high bits, sequence number in the low bits
+	const javelin_u16 sequence = kind == MESSAGE_KIND_SEQUENCED ? ++connection->channels[block->channel].outgoingUnreliableSequence : 0;
+	outgoingBlock->messageId = ((javelin_u32)kind << 16) | sequence;
+	outgoingBlock->channel = block->channel;
+	memcpy( outgoingBlock->payload, block->payload, block->size );
+	outgoingBlock->size = block->size;
+	scheduleSend( state, connection );
+	return JAVELIN_ERROR_OK;
+}
+
+enum JavelinError javelinQueueUnreliableMessage( struct JavelinConnection* connection, struct JavelinMessageBlock* block )
+{
+	if ( connection->state->ioThread != NULL ) {
+		return pushThreadCommand( connection->state, THREAD_COMMAND_UNRELIABLE, connection, block, block->channel, NULL, 0 );
+	}
+	return queueUnreliableMessage( connection, block, MESSAGE_KIND_UNRELIABLE );
+}
+
+enum JavelinError javelinQueueSequencedMessage( struct JavelinConnection* connection, struct JavelinMessageBlock* block )
+{
+	if ( connection->state->ioThread != NULL ) {
+		return pushThreadCommand( connection->state, THREAD_COMMAND_SEQUENCED, connection, block, block->channel, NULL, 0 );
+	}
+	return queueUnreliableMessage( connection, block, MESSAGE_KIND_SEQUENCED );
+}
+
+enum JavelinError javelinBroadcastMessage( struct JavelinState* state, struct JavelinMessageBlock* block )
+{
+	return javelinBroadcastMessageTo( state, NULL, state->connectionLimit, block );
+}
+
+static enum JavelinError broadcastMessageTo( struct JavelinState* state, struct JavelinConnection** connections, const size_t connectionCount, const struct JavelinMessageBlock* block )
+{
+	if ( !isValidMessage( state, block ) ) {
+		if ( VERBOSE ) printf( "net: Unable to broadcast message: invalid\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+
+	struct JavelinSharedMessage* sharedMessage = allocateSharedMessage( state, block->size );
+	if ( sharedMessage == NULL ) {
+		return JAVELIN_ERROR_MEMORY;
+	}
+	memcpy( sharedMessage->payload, block->payload, block->size );
+	sharedMessage->referenceCount = 1;	// held until every connection has its reference
+
+	enum JavelinError result = JAVELIN_ERROR_OK;
+	for ( size_t i = 0; i < connectionCount; i++ ) {
+		struct JavelinConnection* connection = connections != NULL ? connections[i] : &state->connectionSlots[i];
+		if ( connections == NULL && !connection->isActive ) {
+			continue;
+		}
+		struct JavelinChannel* channel = &connection->channels[block->channel];
+		struct JavelinMessageBlock* outgoingBlock;
+		enum JavelinError queueResult = reserveOutgoingMessage( connection, channel, &outgoingBlock );
+		if ( queueResult != JAVELIN_ERROR_OK ) {
+			result = queueResult;
+			continue;
+		}
+		outgoingBlock->channel = block->channel;
+		outgoingBlock->size = sharedMessage->size;
+		outgoingBlock->sharedMessage = sharedMessage;
+		outgoingBlock->fragmentCount = 0;
+		sharedMessage->referenceCount++;
+		channel->outgoingSharedCount++;
+		commitOutgoingMessage( connection, channel, outgoingBlock );
+	}
+
+	releaseSharedMessage( state, sharedMessage );
+	return result;
+}
+
+// Queues one copy of the message for every listed connection, or every active connection if connections is NULL.
+// If some connections can't take the message, the last error is returned but the others still receive it.
+enum JavelinError javelinBroadcastMessageTo( struct JavelinState* state, struct JavelinConnection** connections, const size_t connectionCount, struct JavelinMessageBlock* block )
+{
+	if ( state->ioThread == NULL ) {
+		return broadcastMessageTo( state, connections, connectionCount, block );
+	}
+	if ( connections == NULL ) {
+		return pushThreadCommand( state, THREAD_COMMAND_BROADCAST, NULL, block, block->channel, NULL, 0 );
+	}
+	if ( connectionCount == 0 ) {
+		return JAVELIN_ERROR_OK;
+	}
+	return pushThreadCommand( state, THREAD_COMMAND_BROADCAST_TO, NULL, block, block->channel, connections, connectionCount );
+}
+
+static enum JavelinError flushConnection( struct JavelinState* state, struct JavelinConnection* connection )
+{
+	if ( !connection->isActive ) {
+		return JAVELIN_ERROR_CONNECTION_INACTIVE;
+	}
+	if ( connection->connectionState == JAVELIN_CONNECTIONSTATE_CONNECTED && (hasUnacknowledgedMessages( connection ) || connection->outgoingUnreliableCount > 0) ) {
+		sendConnectionData( state, connection, getCurrentTime( state ) );
+		scheduleConnection( state, connection, nextConnectionTime( connection ) );
+		flushPackets( state );
+	}
+	return JAVELIN_ERROR_OK;
+}
+
+// Sends everything queued on a connection now, along with any resends due before its next flush, rather than
+// waiting for config.flushInterval to pass. DATA packets still count against config.packetBudget. While the state
+// runs on its own thread, the flush follows the messages queued before it.
+enum JavelinError javelinFlush( struct JavelinConnection* connection )
+{
+	if ( connection->state->ioThread != NULL ) {
+		return pushThreadCommand( connection->state, THREAD_COMMAND_FLUSH, connection, NULL, 0, NULL, 0 );
+	}
+	return flushConnection( connection->state, connection );
+}
+
+// Single producer, single consumer ring of entry indices. Each side only writes its own counter.
+struct JavelinRing {
+	_Atomic javelin_u32 head;	// entries published, written by the producer
+	javelin_u8 headPadding[64];	// keeps the two counters on separate cache lines
+	_Atomic javelin_u32 tail;	// entries consumed, written by the consumer
+	javelin_u8 tailPadding[64];
+	javelin_u32 capacity;	// power of two
+};
+
+struct JavelinThreadCommand {
+	enum JavelinThreadCommandType type;
+	javelin_u32 slot;
+	javelin_u16 generation;	// the connection the game thread meant, in case the slot has been reused since
+	javelin_u32 channel;
+	void* largeData;	// copy of a large message, or a broadcast's connections and their generations, freed once queued
+	size_t largeSize;	// or the number of connections to broadcast to
+};
+
+struct JavelinThreadEvent {
+	struct JavelinEvent event;
+	javelin_u16 generation;
+	javelin_u8* ownedData;	// a reassembled large message, freed once the game thread is done with it
+};
+
+struct JavelinIoThread {
+	struct JavelinState* state;
+#if JAVELIN_IO_THREAD
+#ifdef _WIN32
+	HANDLE handle;
+	CRITICAL_SECTION eventLock;
+	CONDITION_VARIABLE eventPublished;
+#else
+	pthread_t handle;
+	pthread_mutex_t eventLock;
+	pthread_cond_t eventPublished;
+#endif
+	atomic_bool gameThreadWaiting;	// set while javelinWait sleeps on eventPublished
+#endif
+	atomic_bool stop;
+	// Game thread to I/O thread, each command with a message block in commandBlocks
+	struct JavelinRing commandRing;
+	struct JavelinThreadCommand* commands;
+	javelin_u8* commandBlocks;
+	// I/O thread to game thread, each event with a message block in eventBlocks
+	struct JavelinRing eventRing;
+	struct JavelinThreadEvent* events;
+	javelin_u8* eventBlocks;
+	javelin_u32 eventsHeld;	// returned by the last poll, released by the next one
+	javelin_u16* generations;	// generation of each slot as last seen by the game thread, zero if not connected
+};
+
+static void initRing( struct JavelinRing* ring, const javelin_u32 capacity )
+{
+	atomic_init( &ring->head, 0 );
+	atomic_init( &ring->tail, 0 );
+	ring->capacity = capacity;
+}
+
+// Producer side: entries that can be written before the consumer catches up
+static javelin_u32 ringFree( struct JavelinRing* ring )
+{
+	return ring->capacity - (atomic_load_explicit( &ring->head, memory_order_relaxed ) - atomic_load_explicit( &ring->tail, memory_order_acquire ));
+}
+
+// Finds the next free entry, or returns false if the ring is full
+static bool ringReserve( struct JavelinRing* ring, javelin_u32* outIndex )
+{
+	if ( ringFree( ring ) == 0 ) {
+		return false;
+	}
+	*outIndex = atomic_load_explicit( &ring->head, memory_order_relaxed ) & (ring->capacity - 1);
+	return true;
+}
+
+static void ringPublish( struct JavelinRing* ring, const javelin_u32 count )
+{
+	atomic_store_explicit( &ring->head, atomic_load_explicit( &ring->head, memory_order_relaxed ) + count, memory_order_release );
+}
+
+// Consumer side: entries from ringFirst() on are ready to read until released
+static javelin_u32 ringAvailable( struct JavelinRing* ring )
+{
+	return atomic_load_explicit( &ring->head, memory_order_acquire ) - atomic_load_explicit( &ring->tail, memory_order_relaxed );
+}
+
+static javelin_u32 ringFirst( struct JavelinRing* ring )
+{
+	return atomic_load_explicit( &ring->tail, memory_order_relaxed );
+}
+
+static void ringRelease( struct JavelinRing* ring, const javelin_u32 count )
+{
+	atomic_store_explicit( &ring->tail, atomic_load_explicit( &ring->tail, memory_order_relaxed ) + count, memory_order_release );
+}
+
+static void wakeIoThread( struct JavelinState* state )
+{
+	const char wake = 0;
+#ifdef _WIN32
+	sendto( state->socket, &wake, 1, 0, (struct sockaddr*)&state->shared->wakeAddress, sizeof (struct sockaddr_storage) );
+#else
+	if ( write( state->shared->wakePipe[1], &wake, 1 ) != 1 ) {
+		// The pipe is full, so the I/O thread has a wake waiting already
+	}
+#endif
+}
+
+// Called after handing the I/O thread new work. Pairs with the fence in runIoThread(), so either the I/O thread sees
+// the work before it waits, or we see it waiting and wake it. Does nothing if there is no I/O thread.
+static void notifyIoThread( struct JavelinState* state )
+{
+	atomic_thread_fence( memory_order_seq_cst );
+	if ( atomic_exchange( &state->shared->ioThreadSleeping, false ) ) {
+		wakeIoThread( state );
+	}
+}
+
+#if JAVELIN_IO_THREAD
+static void sleepMilliseconds( const javelin_u32 milliseconds )
+{
+#ifdef _WIN32
+	Sleep( milliseconds );
+#else
+	struct timespec ts = { .tv_sec = milliseconds / 1000, .tv_nsec = (long)(milliseconds % 1000) * 1000000 };
+	nanosleep( &ts, NULL );
+#endif
+}
+#endif
+
+#ifdef _WIN32
+// WSAPoll only waits on sockets, so the I/O thread is woken with a one byte datagram to its own socket. It is too
+// short to be mistaken for a packet, and isn't counted as one.
+static bool openWakeSignal( struct JavelinState* state )
+{
+	struct sockaddr_storage* outAddress = &state->shared->wakeAddress;
+	socklen_t length = sizeof (struct sockaddr_storage);
+	if ( getsockname( state->socket, (struct sockaddr*)outAddress, &length ) != 0 ) {
+		return false;
+	}
+	if ( outAddress->ss_family == AF_INET ) {
+		struct sockaddr_in* address = (struct sockaddr_in*)outAddress;
+		if ( address->sin_addr.s_addr == htonl( INADDR_ANY ) ) {
+			address->sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+		}
+	}
+	else if ( outAddress->ss_family == AF_INET6 ) {
+		struct sockaddr_in6* address = (struct sockaddr_in6*)outAddress;
+		if ( memcmp( &address->sin6_addr, &in6addr_any, sizeof (struct in6_addr) ) == 0 ) {
+			address->sin6_addr = in6addr_loopback;
+		}
+	}
+	return true;
+}
+#else
+// The I/O thread is woken through a pipe, kept open until the state is destroyed since other threads may still write
+// to it after the I/O thread stops
+static bool openWakeSignal( struct JavelinState* state )
+{
+	int* wakePipe = state->shared->wakePipe;
+	if ( wakePipe[0] != 0 ) {
+		return true;
+	}
+	int ends[2];
+	if ( pipe( ends ) != 0 ) {
+		return false;
+	}
+	fcntl( ends[0], F_SETFL, O_NONBLOCK );
+	fcntl( ends[1], F_SETFL, O_NONBLOCK );
+	wakePipe[0] = ends[0];
+	wakePipe[1] = ends[1];
+	return true;
+}
+#endif
+
+static void publishThreadCommand( struct JavelinIoThread* thread )
+{
+	ringPublish( &thread->commandRing, 1 );
+	notifyIoThread( thread->state );
+}
+
+// Game thread: passes a queue call on to the I/O thread. Errors that depend on the connection's message rings are
+// only found by the I/O thread, so a full ring holds up the commands behind it instead of failing.
+static enum JavelinError pushThreadCommand( struct JavelinState* state, const enum JavelinThreadCommandType type, struct JavelinConnection* connection, const struct JavelinMessageBlock* block, const javelin_u32 channelIndex, const void* data, const size_t size )
+{
+	struct JavelinIoThread* thread = state->ioThread;
+	if ( connection != NULL && thread->generations[connection->slot] == 0 ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: connection inactive\n" );
+		return JAVELIN_ERROR_CONNECTION_INACTIVE;
+	}
+	if ( block != NULL && !isValidMessage( state, block ) ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: invalid\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+	if ( type == THREAD_COMMAND_LARGE && (size == 0 || size > state->config.maxLargeMessageSize || channelIndex >= state->config.channelCount) ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: invalid\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+	javelin_u32 index;
+	if ( !ringReserve( &thread->commandRing, &index ) ) {
+		if ( VERBOSE ) printf( "net: Unable to queue message: thread queue full\n" );
+		return JAVELIN_ERROR_MESSAGE_BUFFER_FULL;
+	}
+
+	struct JavelinThreadCommand* command = &thread->commands[index];
+	command->type = type;
+	command->slot = connection != NULL ? (javelin_u32)connection->slot : 0;
+	command->generation = connection != NULL ? thread->generations[connection->slot] : 0;
+	command->channel = channelIndex;
+	command->largeData = NULL;
+	command->largeSize = 0;
+	if ( block != NULL ) {
+		struct JavelinMessageBlock* commandBlock = getMessageBlock( state, thread->commandBlocks, thread->commandRing.capacity, index );
+		memcpy( commandBlock->payload, block->payload, block->size );
+		commandBlock->channel = block->channel;
+		commandBlock->size = block->size;
+	}
+	enum JavelinError result = JAVELIN_ERROR_OK;
+	if ( type == THREAD_COMMAND_BROADCAST_TO ) {
+		// data is the list of size connections, kept with the generation of each so the message goes only to them
+		struct JavelinConnection* const* connections = (struct JavelinConnection* const*)data;
+		struct JavelinConnection** targets = (struct JavelinConnection**)malloc( size * (sizeof (struct JavelinConnection*) + sizeof (javelin_u16)) );
+		if ( targets == NULL ) {
+			return JAVELIN_ERROR_MEMORY;
+		}
+		javelin_u16* generations = (javelin_u16*)&targets[size];
+		size_t targetCount = 0;
+		for ( size_t i = 0; i < size; i++ ) {
+			if ( thread->generations[connections[i]->slot] == 0 ) {
+				result = JAVELIN_ERROR_CONNECTION_INACTIVE;
+				continue;
+			}
+			targets[targetCount] = connections[i];
+			generations[targetCount] = thread->generations[connections[i]->slot];
+			targetCount++;
+		}
+		command->largeData = targets;
+		command->largeSize = targetCount;
+	}
+	else if ( data != NULL ) {
+		command->largeData = malloc( size );
+		if ( command->largeData == NULL ) {
+			return JAVELIN_ERROR_MEMORY;
+		}
+		memcpy( command->largeData, data, size );
+		command->largeSize = size;
+	}
+	publishThreadCommand( thread );
+	return result;
+}
+
+// Game thread: the message is written straight into the command ring, and nothing else may be queued until it is committed
+static enum JavelinError beginThreadMessage( struct JavelinConnection* connection, const javelin_u32 channelIndex, struct JavelinMessageBlock** outBlock )
+{
+	struct JavelinState* state = connection->state;
+	struct JavelinIoThread* thread = state->ioThread;
+	if ( thread->generations[connection->slot] == 0 ) {
+		if ( VERBOSE ) printf( "net: Unable to begin message: connection inactive\n" );
+		return JAVELIN_ERROR_CONNECTION_INACTIVE;
+	}
+	if ( channelIndex >= state->config.channelCount ) {
+		if ( VERBOSE ) printf( "net: Unable to begin message: invalid channel\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+	javelin_u32 index;
+	if ( !ringReserve( &thread->commandRing, &index ) ) {
+		if ( VERBOSE ) printf( "net: Unable to begin message: thread queue full\n" );
+		return JAVELIN_ERROR_MESSAGE_BUFFER_FULL;
+	}
+
+	struct JavelinThreadCommand* command = &thread->commands[index];
+	command->type = THREAD_COMMAND_MESSAGE;
+	command->slot = (javelin_u32)connection->slot;
+	command->generation = thread->generations[connection->slot];
+	command->channel = channelIndex;
+	command->largeData = NULL;
+	command->largeSize = 0;
+	struct JavelinMessageBlock* block = getMessageBlock( state, thread->commandBlocks, thread->commandRing.capacity, index );
+	block->channel = channelIndex;
+	block->size = 0;
+	block->capacity = state->config.maxMessageSize;
+	*outBlock = block;
+	return JAVELIN_ERROR_OK;
+}
+
+static enum JavelinError commitThreadMessage( struct JavelinConnection* connection, struct JavelinMessageBlock* block )
+{
+	struct JavelinState* state = connection->state;
+	struct JavelinIoThread* thread = state->ioThread;
+	javelin_u32 index;
+	if ( !ringReserve( &thread->commandRing, &index ) || block != getMessageBlock( state, thread->commandBlocks, thread->commandRing.capacity, index ) || thread->commands[index].slot != connection->slot ) {
+		if ( VERBOSE ) printf( "net: Unable to commit message: not reserved with javelinBeginMessage\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+	if ( !isValidMessage( state, block ) ) {
+		if ( VERBOSE ) printf( "net: Unable to commit message: invalid\n" );
+		return JAVELIN_ERROR_INVALID_MESSAGE;
+	}
+	thread->commands[index].channel = block->channel;
+	publishThreadCommand( thread );
 	return JAVELIN_ERROR_OK;
 }
 
+// Game thread: events stay in the ring until the next poll, so the messages they point to stay valid until then
+static void releaseThreadEvents( struct JavelinIoThread* thread )
+{
+	const javelin_u32 first = ringFirst( &thread->eventRing );
+	for ( javelin_u32 i = 0; i < thread->eventsHeld; i++ ) {
+		struct JavelinThreadEvent* entry = &thread->events[(first + i) & (thread->eventRing.capacity - 1)];
+		free( entry->ownedData );
+		entry->ownedData = NULL;
+	}
+	ringRelease( &thread->eventRing, thread->eventsHeld );
+	thread->eventsHeld = 0;
+}
+
+static size_t pollThreadEvents( struct JavelinState* state, struct JavelinEvent* events, const size_t maxEvents )
+{
+	struct JavelinIoThread* thread = state->ioThread;
+	releaseThreadEvents( thread );
+	const javelin_u32 first = ringFirst( &thread->eventRing );
+	const javelin_u32 available = ringAvailable( &thread->eventRing );
+	const javelin_u32 eventCount = available < maxEvents ? available : (javelin_u32)maxEvents;
+	for ( javelin_u32 i = 0; i < eventCount; i++ ) {
+		const struct JavelinThreadEvent* entry = &thread->events[(first + i) & (thread->eventRing.capacity - 1)];
+		events[i] = entry->event;
+		if ( entry->event.type == JAVELIN_EVENT_CONNECT ) {
+			thread->generations[entry->event.connection->slot] = entry->generation;
+		}
+		else if ( entry->event.type == JAVELIN_EVENT_DISCONNECT ) {
+			thread->generations[entry->event.connection->slot] = 0;
+		}
+	}
+	thread->eventsHeld = eventCount;
+	return eventCount;
+}
+
+// Game thread: sleeps until the I/O thread publishes events the last poll hasn't returned, or maxWaitMs passes
+static bool waitForThreadEvents( struct JavelinState* state, const javelin_u32 maxWaitMs )
+{
+	struct JavelinIoThread* thread = state->ioThread;
+#if JAVELIN_IO_THREAD
+	const javelin_u64 startTime = getWallClockTime();
+#ifdef _WIN32
+	EnterCriticalSection( &thread->eventLock );
+#else
+	pthread_mutex_lock( &thread->eventLock );
+#endif
+	// Pairs with the fence in notifyGameThread(), so either it sees us waiting or we see its events
+	atomic_store( &thread->gameThreadWaiting, true );
+	atomic_thread_fence( memory_order_seq_cst );
+	bool ready;
+	while ( !(ready = ringAvailable( &thread->eventRing ) > thread->eventsHeld) ) {
+		const javelin_u64 waitedMs = getWallClockTime() - startTime;
+		if ( waitedMs >= maxWaitMs ) {
+			break;
+		}
+		const javelin_u32 remainingMs = maxWaitMs - (javelin_u32)waitedMs;
+#ifdef _WIN32
+		SleepConditionVariableCS( &thread->eventPublished, &thread->eventLock, remainingMs );
+#else
+		struct timespec deadline;
+		clock_gettime( CLOCK_REALTIME, &deadline );
+		deadline.tv_sec += remainingMs / 1000;
+		deadline.tv_nsec += (long)(remainingMs % 1000) * 1000000;
+		if ( deadline.tv_nsec >= 1000000000 ) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait( &thread->eventPublished, &thread->eventLock, &deadline );
+#endif
+	}
+	atomic_store( &thread->gameThreadWaiting, false );
+#ifdef _WIN32
+	LeaveCriticalSection( &thread->eventLock );
+#else
+	pthread_mutex_unlock( &thread->eventLock );
+#endif
+	return ready;
+#else
+	(void)maxWaitMs;
+	return ringAvailable( &thread->eventRing ) > thread->eventsHeld;
+#endif
+}
+
+// I/O thread: runs commands in order. Returns false if a reliable message has to wait for room in its message ring,
+// which holds up the commands behind it until an ack frees some.
+static bool runThreadCommands( struct JavelinIoThread* thread )
+{
+	struct JavelinState* state = thread->state;
+	const javelin_u32 first = ringFirst( &thread->commandRing );
+	const javelin_u32 available = ringAvailable( &thread->commandRing );
+	javelin_u32 doneCount = 0;
+	bool blocked = false;
+	while ( doneCount < available && !blocked ) {
+		const javelin_u32 index = (first + doneCount) & (thread->commandRing.capacity - 1);
+		struct JavelinThreadCommand* command = &thread->commands[index];
+		const struct JavelinMessageBlock* block = getMessageBlock( state, thread->commandBlocks, thread->commandRing.capacity, index );
+		struct JavelinConnection* connection = &state->connectionSlots[command->slot];
+		const bool isCurrent = connection->isActive && connection->generation == command->generation;
+		if ( command->type == THREAD_COMMAND_MESSAGE && isCurrent ) {
+			blocked = queueMessage( connection, block ) == JAVELIN_ERROR_MESSAGE_BUFFER_FULL;
+		}
+		else if ( command->type == THREAD_COMMAND_UNRELIABLE && isCurrent ) {
+			queueUnreliableMessage( connection, block, MESSAGE_KIND_UNRELIABLE );
+		}
+		else if ( command->type == THREAD_COMMAND_SEQUENCED && isCurrent ) {
+			queueUnreliableMessage( connection, block, MESSAGE_KIND_SEQUENCED );
+		}
+		else if ( command->type == THREAD_COMMAND_BROADCAST ) {
+			broadcastMessageTo( state, NULL, state->connectionLimit, block );
+		}
+		else if ( command->type == THREAD_COMMAND_BROADCAST_TO ) {
+			// Connections that have gone since the call are left out, the rest share one copy of the message
+			struct JavelinConnection** targets = (struct JavelinConnection**)command->largeData;
+			const javelin_u16* generations = (const javelin_u16*)&targets[command->largeSize];
+			size_t currentCount = 0;
+			for ( size_t i = 0; i < command->largeSize; i++ ) {
+				if ( targets[i]->isActive && targets[i]->generation == generations[i] ) {
+					targets[currentCount++] = targets[i];
+				}
+			}
+			broadcastMessageTo( state, targets, currentCount, block );
+		}
+		else if ( command->type == THREAD_COMMAND_LARGE && isCurrent ) {
+			blocked = queueLargeMessage( connection, command->channel, command->largeData, command->largeSize ) == JAVELIN_ERROR_MESSAGE_BUFFER_FULL;
+		}
+		else if ( command->type == THREAD_COMMAND_FLUSH && isCurrent ) {
+			flushConnection( state, connection );
+		}
+		else if ( command->type == THREAD_COMMAND_DISCONNECT ) {
+			disconnectState( state );
+		}
+		if ( !blocked ) {
+			free( command->largeData );
+			command->largeData = NULL;
+			doneCount++;
+		}
+	}
+	ringRelease( &thread->commandRing, doneCount );
+	return !blocked;
+}
+
+#if JAVELIN_IO_THREAD
+// I/O thread: called after publishing events, wakes the game thread if it is in javelinWait
+static void notifyGameThread( struct JavelinIoThread* thread )
+{
+	atomic_thread_fence( memory_order_seq_cst );
+	if ( !atomic_load( &thread->gameThreadWaiting ) ) {
+		return;
+	}
+#ifdef _WIN32
+	EnterCriticalSection( &thread->eventLock );
+	WakeConditionVariable( &thread->eventPublished );
+	LeaveCriticalSection( &thread->eventLock );
+#else
+	pthread_mutex_lock( &thread->eventLock );
+	pthread_cond_signal( &thread->eventPublished );
+	pthread_mutex_unlock( &thread->eventLock );
+#endif
+}
+
+// I/O thread: moves events into the event ring, copying their messages out of the packets they arrived in
+static void pushThreadEvents( struct JavelinIoThread* thread )
+{
+	struct JavelinState* state = thread->state;
+	struct JavelinEvent polledEvents[JAVELIN_PACKET_BATCH_SIZE];
+	while ( true ) {
+		const javelin_u32 room = ringFree( &thread->eventRing );
+		const size_t eventCount = pollEvents( state, polledEvents, room < JAVELIN_PACKET_BATCH_SIZE ? room : JAVELIN_PACKET_BATCH_SIZE );
+		if ( eventCount == 0 ) {
+			return;
+		}
+		const javelin_u32 head = atomic_load_explicit( &thread->eventRing.head, memory_order_relaxed );
+		for ( size_t i = 0; i < eventCount; i++ ) {
+			const javelin_u32 index = (head + (javelin_u32)i) & (thread->eventRing.capacity - 1);
+			struct JavelinThreadEvent* entry = &thread->events[index];
+			entry->event = polledEvents[i];
+			entry->generation = polledEvents[i].connection->generation;
+			entry->ownedData = NULL;
+			if ( polledEvents[i].type != JAVELIN_EVENT_DATA ) {
+				continue;
+			}
+			const struct JavelinMessageBlock* message = polledEvents[i].message;
+			struct JavelinMessageBlock* block = getMessageBlock( state, thread->eventBlocks, thread->eventRing.capacity, index );
+			block->messageId = message->messageId;
+			block->channel = message->channel;
+			block->size = message->size;
+			block->incomingReadOffset = 0;
+			block->incomingData = NULL;
+			if ( message->size > state->config.maxMessageSize ) {
+				// A reassembled large message comes from the event pool, so take its buffer rather than copy it
+				struct JavelinEventMessage* eventMessage = (struct JavelinEventMessage*)message;
+				entry->ownedData = eventMessage->ownedData;
+				eventMessage->ownedData = NULL;
+				block->incomingData = entry->ownedData;
+			}
+			else {
+				memcpy( block->payload, javelinGetMessageData( message ), message->size );
+			}
+			entry->event.message = block;
+		}
+		ringPublish( &thread->eventRing, (javelin_u32)eventCount );
+		notifyGameThread( thread );
+	}
+}
+
+static void runIoThread( struct JavelinIoThread* thread )
+{
+	struct JavelinState* state = thread->state;
+	while ( !atomic_load( &thread->stop ) ) {
+		const bool commandsBlocked = !runThreadCommands( thread );
+		updateState( state );
+		pushThreadEvents( thread );
+
+		atomic_store( &state->shared->ioThreadSleeping, true );
+		atomic_thread_fence( memory_order_seq_cst );
+		if ( (commandsBlocked || ringAvailable( &thread->commandRing ) == 0) && !atomic_load( &state->shared->concurrentPending ) && !atomic_load( &thread->stop ) ) {
+			if ( ringFree( &thread->eventRing ) == 0 ) {
+				// The game thread is behind, so leave packets in the socket until it catches up
+				sleepMilliseconds( 1 );
+			}
+			else {
+				waitForPacket( state, UINT32_MAX );
+			}
+		}
+		atomic_store( &state->shared->ioThreadSleeping, false );
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI ioThreadMain( LPVOID argument )
+{
+	runIoThread( (struct JavelinIoThread*)argument );
+	return 0;
+}
+#else
+static void* ioThreadMain( void* argument )
+{
+	runIoThread( (struct JavelinIoThread*)argument );
+	return NULL;
+}
+#endif
+#endif
+
+static void freeIoThread( struct JavelinIoThread* thread )
+{
+	if ( thread->commands != NULL ) {
+		const javelin_u32 first = ringFirst( &thread->commandRing );
+		for ( javelin_u32 i = 0; i < ringAvailable( &thread->commandRing ); i++ ) {
+			free( thread->commands[(first + i) & (thread->commandRing.capacity - 1)].largeData );
+		}
+	}
+	if ( thread->events != NULL ) {
+		const javelin_u32 first = ringFirst( &thread->eventRing );
+		for ( javelin_u32 i = 0; i < ringAvailable( &thread->eventRing ); i++ ) {
+			free( thread->events[(first + i) & (thread->eventRing.capacity - 1)].ownedData );
+		}
+	}
+	free( thread->commands );
+	free( thread->commandBlocks );
+	free( thread->events );
+	free( thread->eventBlocks );
+	free( thread->generations );
+#if JAVELIN_IO_THREAD
+#ifdef _WIN32
+	DeleteCriticalSection( &thread->eventLock );
+#else
+	pthread_mutex_destroy( &thread->eventLock );
+	pthread_cond_destroy( &thread->eventPublished );
+#endif
+#endif
+	free( thread );
+}
+
+// Hands the state to a thread of its own, which does all receiving, sending and resending from then on, so the timing
+// of acks no longer depends on how often the game thread gets round to it. The game thread keeps making the same
+// calls, which pass messages and events through rings of queueSize entries (a power of two). Connect first.
+enum JavelinError javelinStartThread( struct JavelinState* state, const javelin_u32 queueSize )
+{
+	// Simulated time only moves when the caller advances it, so there is nothing for a thread to keep up with
+	if ( state->ioThread != NULL || state->simulator != NULL || !isPowerOfTwo( queueSize ) ) {
+		return JAVELIN_ERROR_INVALID_CONFIG;
+	}
+	struct JavelinIoThread* thread = (struct JavelinIoThread*)calloc( 1, sizeof (struct JavelinIoThread) );
+	if ( thread == NULL ) {
+		return JAVELIN_ERROR_MEMORY;
+	}
+	thread->state = state;
+#if JAVELIN_IO_THREAD
+#ifdef _WIN32
+	InitializeCriticalSection( &thread->eventLock );
+	InitializeConditionVariable( &thread->eventPublished );
+#else
+	pthread_mutex_init( &thread->eventLock, NULL );
+	pthread_cond_init( &thread->eventPublished, NULL );
+#endif
+	atomic_init( &thread->gameThreadWaiting, false );
+#endif
+	initRing( &thread->commandRing, queueSize );
+	initRing( &thread->eventRing, queueSize );
+	atomic_init( &thread->stop, false );
+	thread->commands = (struct JavelinThreadCommand*)calloc( queueSize, sizeof (struct JavelinThreadCommand) );
+	thread->commandBlocks = allocateMessageBuffer( state, queueSize );
+	thread->events = (struct JavelinThreadEvent*)calloc( queueSize, sizeof (struct JavelinThreadEvent) );
+	thread->eventBlocks = allocateMessageBuffer( state, queueSize );
+	thread->generations = (javelin_u16*)malloc( sizeof (javelin_u16) * state->connectionLimit );
+	if ( thread->commands == NULL || thread->commandBlocks == NULL || thread->events == NULL || thread->eventBlocks == NULL || thread->generations == NULL ) {
+		freeIoThread( thread );
+		return JAVELIN_ERROR_MEMORY;
+	}
+	for ( javelin_u32 i = 0; i < state->connectionLimit; i++ ) {
+		thread->generations[i] = state->connectionSlots[i].isActive ? state->connectionSlots[i].generation : 0;
+	}
+	if ( !openWakeSignal( state ) ) {
+		freeIoThread( thread );
+		return JAVELIN_ERROR_SOCKET;
+	}
 
+	state->ioThread = thread;
+#if !JAVELIN_IO_THREAD
+	const bool started = false;
+#elif defined(_WIN32)
+	thread->handle = CreateThread( NULL, 0, ioThreadMain, thread, 0, NULL );
+	const bool started = thread->handle != NULL;
+#else
+	const bool started = pthread_create( &thread->handle, NULL, ioThreadMain, thread ) == 0;
+#endif
+	if ( !started ) {
+		state->ioThread = NULL;
+		freeIoThread( thread );
+		return JAVELIN_ERROR_THREAD;
+	}
+	return JAVELIN_ERROR_OK;
+}
 
+// Waits for the I/O thread to finish and hands the state back to the calling thread. Commands the thread hadn't got
+// to are run now, and events that were never polled are dropped.
+void javelinStopThread( struct JavelinState* state )
+{
+	struct JavelinIoThread* thread = state->ioThread;
+	if ( thread == NULL ) {
+		return;
+	}
+#if JAVELIN_IO_THREAD
+	atomic_store( &thread->stop, true );
+	wakeIoThread( state );
+#ifdef _WIN32
+	WaitForSingleObject( thread->handle, INFINITE );
+	CloseHandle( thread->handle );
+#else
+	pthread_join( thread->handle, NULL );
+#endif
+#endif
+	state->ioThread = NULL;
+	runThreadCommands( thread );
+	flushPackets( state );
+	releaseThreadEvents( thread );
+	freeIoThread( thread );
+}
@@ -7,9 +7,24 @@
 #ifndef JAVELIN_MAX_MESSAGES 
 #define JAVELIN_MAX_MESSAGES 4096
 #endif
+#ifndef JAVELIN_INITIAL_MESSAGES
+#define JAVELIN_INITIAL_MESSAGES 16
+#endif
 #ifndef JAVELIN_MAX_PACKET_SIZE 
 #define JAVELIN_MAX_PACKET_SIZE 1400
 #endif
+// Large messages are split into fragments of this many bytes, each sent as its own reliable message
+#ifndef JAVELIN_FRAGMENT_SIZE
+#define JAVELIN_FRAGMENT_SIZE 1024
+#endif
+#ifndef JAVELIN_MAX_LARGE_MESSAGE_SIZE
+#define JAVELIN_MAX_LARGE_MESSAGE_SIZE (512 * 1024)
+#endif
+// Channels are numbered from 0 up to config.channelCount - 1, this limit is fixed by the message header format
+#define JAVELIN_MAX_CHANNELS 8
+#ifndef JAVELIN_MAX_UNRELIABLE_MESSAGES
+#define JAVELIN_MAX_UNRELIABLE_MESSAGES 256
+#endif
 #ifndef JAVELIN_MAX_PENDING_CONNECTIONS
 #define JAVELIN_MAX_PENDING_CONNECTIONS 128
 #endif
@@ -17,7 +32,55 @@
 #define JAVELIN_CONNECTION_TIMEOUT_MS 5000
 #endif
 
+#ifndef JAVELIN_PACKET_BATCH_SIZE
+#define JAVELIN_PACKET_BATCH_SIZE 32
+#endif
+#ifndef JAVELIN_BATCHED_IO
+#ifdef __linux__
+#define JAVELIN_BATCHED_IO 1
+#else
+#define JAVELIN_BATCHED_IO 0
+#endif
+#endif
+// Set to 0 to leave out javelinStartThread() and the dependency on pthreads
+#ifndef JAVELIN_IO_THREAD
+#define JAVELIN_IO_THREAD 1
+#endif
+// Set to 1 to call config.trace at each step of a reliable message's life and keep latency histograms for each connection
+#ifndef JAVELIN_TRACE
+#define JAVELIN_TRACE 0
+#endif
+
 #define JAVELIN_DEFAULT_RETRY_TIME_MS 100
+// How long an ack for received DATA waits for an outgoing DATA packet to ride on before going out alone
+#ifndef JAVELIN_ACK_DELAY_MS
+#define JAVELIN_ACK_DELAY_MS 10
+#endif
+// Default for config.keepaliveInterval
+#ifndef JAVELIN_KEEPALIVE_INTERVAL_MS
+#define JAVELIN_KEEPALIVE_INTERVAL_MS 1000
+#endif
+#ifndef JAVELIN_MIN_RETRY_TIME_MS
+#define JAVELIN_MIN_RETRY_TIME_MS 20
+#endif
+#ifndef JAVELIN_MAX_RETRY_TIME_MS
+#define JAVELIN_MAX_RETRY_TIME_MS 1000
+#endif
+
+// Congestion window limits, in packets per round trip
+#ifndef JAVELIN_INITIAL_CONGESTION_WINDOW
+#define JAVELIN_INITIAL_CONGESTION_WINDOW 8
+#endif
+#ifndef JAVELIN_MIN_CONGESTION_WINDOW
+#define JAVELIN_MIN_CONGESTION_WINDOW 2
+#endif
+#ifndef JAVELIN_MAX_CONGESTION_WINDOW
+#define JAVELIN_MAX_CONGESTION_WINDOW 1024
+#endif
+// How much unused send allowance a connection may save up for a burst
+#ifndef JAVELIN_SEND_BURST_MS
+#define JAVELIN_SEND_BURST_MS 20
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -53,6 +116,9 @@ enum JavelinError {
 	JAVELIN_ERROR_MESSAGE_BUFFER_FULL,
 	JAVELIN_ERROR_CHAR_ARRAY_TOO_LONG,
 	JAVELIN_ERROR_RANDOM_GENERATOR_REQUIRED,
+	JAVELIN_ERROR_INVALID_CONFIG,
+	JAVELIN_ERROR_CONNECTION_INACTIVE,
+	JAVELIN_ERROR_THREAD,
 };
 
 enum JavelinConnectionStateType {
@@ -76,24 +142,142 @@ enum JavelinPacketType {
 	JAVELIN_PACKET_SERVER_FULL,
 };
 
+// Steps in the life of a reliable message or fragment, reported to config.trace when built with JAVELIN_TRACE
+enum JavelinTraceType {
+	JAVELIN_TRACE_QUEUED,	// given an id in its channel's ring
+	JAVELIN_TRACE_SENT,	// written to a DATA packet for the first time
+	JAVELIN_TRACE_RESENT,
+	JAVELIN_TRACE_ACKNOWLEDGED,
+	JAVELIN_TRACE_STORED,	// received and stored in the incoming ring
+	JAVELIN_TRACE_DELIVERED,	// returned as an event
+};
+
+// Counts of intervals in power of two buckets: bucket 0 holds 0 ms, bucket N holds 2^(N-1) up to 2^N - 1 ms,
+// and the last bucket anything longer
+#define JAVELIN_HISTOGRAM_BUCKETS 16
+struct JavelinHistogram {
+	javelin_u32 buckets[JAVELIN_HISTOGRAM_BUCKETS];
+	javelin_u32 count;
+	javelin_u32 max;
+};
+
+// Where the time between queueing a reliable message and its delivery goes
+struct JavelinLatencyHistograms {
+	struct JavelinHistogram queue;	// queued until first sent, waiting for the send rate or a full ring
+	struct JavelinHistogram resend;	// each resend, from the send before it
+	struct JavelinHistogram wire;	// last send until acknowledged, a round trip plus the peer's ack delay
+	struct JavelinHistogram hold;	// stored until delivered, waiting behind an earlier message
+};
+
 struct JavelinPacketHeader {
 	// TODO: header, crc, salt, etc.
 	enum JavelinPacketType type;
-	javelin_u32 ackMessageId;
 	javelin_u32 salt;
+	javelin_u32 latestChannel;
+	javelin_u32 latestMessageId;	// most recently received new message, used for round trip time samples
+	javelin_u32 ackChannelMask;	// bit N set if acks for channel N are included
+	javelin_u32 ackMessageId[JAVELIN_MAX_CHANNELS];
+	javelin_u32 ackBits[JAVELIN_MAX_CHANNELS];	// bit N set if message ackMessageId + 1 + N has also been received
+};
+
+// Payload shared by every connection a message was broadcast to, or by every fragment of a large message,
+// freed once all of them have been acknowledged
+struct JavelinSharedMessage {
+	struct JavelinSharedMessage* nextFree;
+	javelin_u32 referenceCount;
+	size_t size;
+	javelin_u8 payload[];
 };
 
 struct JavelinMessageBlock {
 	javelin_u32 messageId;
+	javelin_u32 channel;	// set before queueing to pick the channel a message is sent on, zero by default
+	struct JavelinSharedMessage* sharedMessage;	// outgoing only, used in place of payload if set
+	const javelin_u8* incomingData;	// incoming only, read in place of payload if set, such as a view into the received packet
+	javelin_u16 fragmentIndex;
+	javelin_u16 fragmentCount;	// non-zero if this is one fragment of a large message
 	javelin_u64 outgoingLastSendTime;
+	javelin_u32 outgoingSendCount;
+	bool outgoingAcknowledged;	// selectively acknowledged, but not yet covered by the cumulative ack
 	size_t incomingReadOffset;
+#if JAVELIN_TRACE
+	javelin_u64 traceTime;	// when an outgoing message was queued or an incoming one stored
+#endif
 	size_t size;
+	size_t capacity;	// payload bytes that may be written, JAVELIN_MAX_MESSAGE_SIZE if zero
 	javelin_u8 payload[JAVELIN_MAX_MESSAGE_SIZE];
 };
 
+// Packs values into a message at the bit level, following whatever has already been written to it.
+// Byte-level javelinWrite* calls must wait until javelinEndBits() has stored the last partial byte.
+struct JavelinBitWriter {
+	struct JavelinMessageBlock* block;
+	javelin_u64 scratch;	// bits not yet stored in the block, lowest first
+	javelin_u32 scratchBits;
+};
+
+struct JavelinBitReader {
+	struct JavelinMessageBlock* block;
+	javelin_u64 scratch;
+	javelin_u32 scratchBits;
+	size_t readOffset;	// next byte of the message to load into scratch
+	bool overflow;	// a read ran past the end of the message, so it and every later read returned zero
+};
+
+struct JavelinConnection;
+
+// Runtime limits for a JavelinState, see javelinCreateConfig() for the defaults
+struct JavelinConfig {
+	javelin_u32 maxMessages;	// upper limit for each message ring, power of two no larger than 32768
+	javelin_u32 initialMessages;	// capacity a message ring starts with when first used, power of two
+	javelin_u32 maxMessageSize;	// no larger than JAVELIN_MAX_MESSAGE_SIZE
+	javelin_u32 maxSendRate;	// bytes per second for each connection, zero for no limit beyond congestion control
+	javelin_u32 maxUnreliableMessages;	// unreliable messages each connection can have waiting to be sent, power of two
+	javelin_u32 channelCount;	// independently ordered channels per connection, up to JAVELIN_MAX_CHANNELS
+	javelin_u32 maxLargeMessageSize;	// largest message javelinQueueLargeMessage() sends or a peer may send
+	javelin_u32 flushInterval;	// milliseconds between DATA packets to a connection, so messages queued in between share them; zero sends on the next javelinUpdate()
+	javelin_u32 packetBudget;	// most DATA packets each javelinUpdate() sends across all connections, zero for no limit
+	javelin_u32 keepaliveInterval;	// milliseconds a connection may go without sending before it pings, less than JAVELIN_CONNECTION_TIMEOUT_MS
+	bool reusePort;	// bind with SO_REUSEPORT so several states can share a port, see javelinCreateShards()
+	javelin_u64 (*clock)( void* context );	// current time in milliseconds, or NULL for the wall clock
+	void* clockContext;
+	// Called with traceContext as reliable messages are queued, sent, acknowledged, stored and delivered, if built with JAVELIN_TRACE
+	void (*trace)( void* context, struct JavelinConnection* connection, enum JavelinTraceType type, javelin_u32 channel, javelin_u16 messageId, javelin_u64 timeMs );
+	void* traceContext;
+};
+
+// Reliable messages on one channel are delivered in order, but never wait for messages on another channel.
+// Message rings are allocated on first use and grow as needed, up to config.maxMessages.
+// Entries are messageStride bytes apart, with payloads truncated to config.maxMessageSize.
+struct JavelinChannel {
+	javelin_u8* incomingMessageBuffer;
+	javelin_u32 incomingMessageCapacity;
+	javelin_u16 incomingLastIdProcessed;
+	javelin_u16 incomingLatestId;
+	javelin_u16 incomingUnreliableSequence;	// last sequenced message delivered, older ones are dropped
+	javelin_u16 incomingPollFirstId;	// first message delivered by poll number incomingPollCount, whose events still point into the ring
+	javelin_u32 incomingPollCount;
+	javelin_u8* incomingLargeBuffer;	// fragments delivered so far of the large message being reassembled
+	javelin_u32 incomingLargeSize;
+	javelin_u16 incomingLargeFragmentCount;
+	javelin_u8* outgoingMessageBuffer;
+	javelin_u32 outgoingMessageCapacity;
+	javelin_u16 outgoingLastIdSent;
+	javelin_u16 outgoingLastIdAcknowledged;
+	javelin_u16 outgoingLastIdSampled;
+	javelin_u16 outgoingUnreliableSequence;
+	javelin_u32 outgoingSharedCount;
+};
+
+struct JavelinState;
+
 struct JavelinConnection {
-	bool isActive;
+	// Fixed when the state is created, so these can be read from any thread
+	struct JavelinState* state;
 	size_t slot;
+	// Everything from here on is cleared when the slot is reused
+	bool isActive;
+	javelin_u16 generation;	// bumped each time the slot is reused, to tell connection handles apart
 	size_t userValue;
 	struct sockaddr_storage address;
 	enum JavelinConnectionStateType connectionState;
@@ -101,12 +285,38 @@ struct JavelinConnection {
 	javelin_u32 remoteSalt;
 	javelin_u64 lastSendTime;
 	javelin_u64 lastReceiveTime;
-	javelin_u32 retryTime;
-	struct JavelinMessageBlock incomingMessageBuffer[JAVELIN_MAX_MESSAGES];
-	javelin_u16 incomingLastIdProcessed;
-	struct JavelinMessageBlock outgoingMessageBuffer[JAVELIN_MAX_MESSAGES];
-	javelin_u16 outgoingLastIdSent;
-	javelin_u16 outgoingLastIdAcknowledged;
+	javelin_u32 retryTime;	// retransmit timeout, derived from the measured round trip time
+	javelin_u32 roundTripTime;	// smoothed, in milliseconds, zero until the first measurement
+	javelin_u32 roundTripTimeVariance;
+	javelin_u32 retryBackoff;	// retryTime is doubled this many times while the oldest message goes unacknowledged
+	javelin_u32 timerIndex;	// position in the timer heap plus one, or zero if not scheduled
+	javelin_u64 bytesSent;
+	javelin_u64 bytesReceived;
+	javelin_u64 packetsSent;
+	javelin_u64 packetsReceived;
+	javelin_u64 messagesResent;	// reliable messages and fragments sent again after going unacknowledged
+	javelin_u64 duplicateMessages;	// received again while already waiting in the incoming ring
+	javelin_u64 oldMessages;	// received again after being delivered
+#if JAVELIN_TRACE
+	struct JavelinLatencyHistograms latency;	// queue, resend and wire for messages sent on this connection, hold for those received
+#endif
+	// DATA packets are paced by a token bucket refilled at sendRate bytes per second, which is the
+	// lower of config.maxSendRate and congestionWindow packets per round trip
+	javelin_u32 sendRate;
+	javelin_s64 sendAllowance;
+	javelin_u64 sendAllowanceTime;
+	javelin_u32 congestionWindow;
+	javelin_u32 congestionThreshold;	// slow start doubles the window each round trip until it reaches this
+	javelin_u64 congestionChangeTime;
+	bool outgoingThrottled;	// the last DATA pass stopped early because the allowance or config.packetBudget ran out
+	bool outgoingQueued;	// messages queued since the last DATA pass
+	javelin_u64 outgoingFlushTime;	// time of the last DATA pass
+	javelin_u64 outgoingOldestSendTime;
+	struct JavelinChannel channels[JAVELIN_MAX_CHANNELS];
+	javelin_u32 incomingLatestChannel;	// channel of the most recently received new message
+	javelin_u64 incomingAckTime;	// when reliable messages first arrived since the last packet that carried an ack, zero if none
+	javelin_u8* outgoingUnreliableBuffer;	// config.maxUnreliableMessages entries, allocated on first use
+	javelin_u32 outgoingUnreliableCount;
 };
 
 struct JavelinPendingConnection {
@@ -118,17 +328,142 @@ struct JavelinPendingConnection {
 	javelin_u64 lastReceiveTime;
 };
 
+struct JavelinTimer {
+	javelin_u64 time;
+	javelin_u32 slot;
+};
+
+struct JavelinAddressEntry {
+	struct sockaddr_storage* address;	// NULL if the entry is empty
+	javelin_u32 hash;
+	javelin_u32 index;
+};
+
+// Open addressing hash table mapping a remote address and port to a slot index
+struct JavelinAddressTable {
+	struct JavelinAddressEntry* entries;
+	javelin_u32 mask;
+	javelin_u32 seed;	// mixed into every hash, so remote peers can't predict where their addresses land
+};
+
+struct JavelinPacket {
+	struct sockaddr_storage address;
+	size_t size;
+	javelin_u8 data[JAVELIN_MAX_PACKET_SIZE];
+};
+
+// Link conditions applied by a JavelinSimulator to every packet it carries
+struct JavelinLinkConditions {
+	javelin_u32 latencyMs;	// one way delay
+	javelin_u32 jitterMs;	// up to this much extra delay, chosen per packet
+	float lossRate;	// chance of a packet being dropped, 0 to 1
+	float duplicateRate;	// chance of a packet arriving twice
+	float reorderRate;	// chance of a packet being held back long enough for later ones to overtake it
+};
+
+struct JavelinSimulatedPacket {
+	javelin_u64 deliveryTime;
+	javelin_u64 sequence;	// breaks ties between packets due at the same time, in the order they were sent
+	struct JavelinPacket packet;
+};
+
+struct JavelinSimulatedEndpoint {
+	struct JavelinState* state;
+	// Min-heap of packets on their way to this endpoint, ordered by delivery time
+	struct JavelinSimulatedPacket* packets;
+	javelin_u32 packetCount;
+	javelin_u32 packetCapacity;
+};
+
+// Carries packets between states in the same process, with its own clock and a seeded random
+// generator, so a run repeats exactly
+struct JavelinSimulator {
+	javelin_u64 time;
+	javelin_u64 randomState;
+	javelin_u64 nextSequence;
+	struct JavelinLinkConditions conditions;	// may be changed between calls
+	struct JavelinSimulatedEndpoint* endpoints;
+	javelin_u32 endpointCount;
+	javelin_u32 endpointLimit;
+	struct JavelinAddressTable endpointTable;
+	javelin_u16 nextPort;
+	javelin_u64 packetsSent;
+	javelin_u64 packetsDelivered;
+	javelin_u64 packetsLost;
+	javelin_u64 packetsDuplicated;
+};
+
+struct JavelinEventMessage {
+	struct JavelinMessageBlock block;
+	javelin_u8* ownedData;	// a reassembled large message, freed when the entry is reused
+};
+
+struct JavelinEvent;
+struct JavelinIoThread;
+struct JavelinSharedState;
+
 struct JavelinState {
 	javelin_u32 (*randomGenerator)( void );
+	struct JavelinConfig config;
+	size_t messageStride;
 	struct JavelinConnection* connectionSlots;
 	javelin_u32 connectionLimit;
+	struct JavelinAddressTable connectionTable;
 	struct JavelinPendingConnection pendingConnectionSlots[JAVELIN_MAX_PENDING_CONNECTIONS];
 	javelin_u32 pendingConnectionCount;
+	struct JavelinAddressTable pendingConnectionTable;
+	javelin_u64 pendingConnectionTimeoutTime;
+	// Totals for every packet, including those that belong to no connection yet
+	javelin_u64 packetsSent;
+	javelin_u64 packetsReceived;
+	javelin_u64 bytesSent;
+	javelin_u64 bytesReceived;
+	javelin_u64 serverFullReplies;
+	javelin_u64 socketErrors;
+	javelin_u32 packetBudgetLeft;	// DATA packets left in config.packetBudget until the next javelinUpdate
+	javelin_u64 packetBudgetTime;	// when packetBudgetLeft was last refilled
+	// Min-heap of the next time each active connection has a resend, ping or timeout due
+	struct JavelinTimer* timerHeap;
+	javelin_u32 timerCount;
+	struct JavelinSharedMessage* sharedMessageFreeList;
 	javelin_u32 incomingLastPacketSlot;
-	javelin_u8 outgoingPacketBuffer[JAVELIN_MAX_PACKET_SIZE];
+	// Unreliable messages are delivered straight from the DATA packet they arrived in
+	const struct JavelinPacket* incomingUnreliablePacket;
+	size_t incomingUnreliableOffset;
+	javelin_u32 incomingUnreliableSlot;
+	// Blocks for event messages that don't live in a message ring, reused by the next javelinPollEvents
+	struct JavelinEventMessage* eventMessages;
+	javelin_u32 eventMessageCapacity;
+	javelin_u32 eventMessageCount;
+	javelin_u32 pollCount;	// bumped by each javelinPollEvents, to tell which channels have delivered during the current one
+	// Incoming rings replaced during a javelinPollEvents, freed by the next one
+	javelin_u8** retiredBuffers;
+	javelin_u32 retiredBufferCount;
+	javelin_u32 retiredBufferCapacity;
+	// Disconnects found by javelinUpdate, returned by the next javelinPollEvents
+	struct JavelinEvent* queuedEvents;
+	javelin_u32 queuedEventCount;
+	javelin_u32 queuedEventIndex;
+	// Outgoing packets are written in place, straight into the next free entry of outgoingPackets
+	javelin_u8* outgoingPacketBuffer;
 	size_t outgoingPacketSize;
+#if JAVELIN_BATCHED_IO
+	// Packets are received with recvmmsg() and sent with sendmmsg() in batches
+	struct JavelinPacket outgoingPackets[JAVELIN_PACKET_BATCH_SIZE];
+	javelin_u32 outgoingPacketCount;
+	struct JavelinPacket incomingPackets[JAVELIN_PACKET_BATCH_SIZE];
+#else
+	struct JavelinPacket outgoingPackets[1];
+	struct JavelinPacket incomingPackets[1];
+#endif
+	javelin_u32 incomingPacketCount;
+	javelin_u32 incomingPacketIndex;
 	int socket;
 	struct sockaddr_storage address;
+	javelin_u16 shardIndex;	// position among the states made by javelinCreateShards(), zero otherwise
+	struct JavelinIoThread* ioThread;	// set while javelinStartThread() runs the state on its own thread
+	struct JavelinSharedState* shared;	// the parts other threads may touch, such as javelinQueueMessageConcurrent() queues
+	struct JavelinSimulator* simulator;	// set by javelinCreateSimulated(), which replaces the socket
 };
 
 enum JavelinEventType {
@@ -143,13 +478,60 @@ struct JavelinEvent {
 	struct JavelinMessageBlock* message;
 };
 
+// Counters from javelinGetStats() or javelinGetConnectionStats(). The state totals also cover handshakes
+// and packets from unknown addresses, so they can exceed the sum of the connections.
+struct JavelinStats {
+	javelin_u64 packetsSent;
+	javelin_u64 packetsReceived;
+	javelin_u64 bytesSent;
+	javelin_u64 bytesReceived;
+	javelin_u64 messagesResent;
+	javelin_u64 duplicateMessages;
+	javelin_u64 oldMessages;
+	javelin_u64 serverFullReplies;	// state only
+	javelin_u64 socketErrors;	// state only
+	javelin_u32 queuedMessages;	// reliable messages queued but not yet acknowledged
+	javelin_u32 connectionCount;	// state only, active connections
+	javelin_u32 pendingConnectionCount;	// state only, handshakes in progress
+	javelin_u32 roundTripTime;	// connection only
+};
+
+struct JavelinConfig javelinCreateConfig( void );
 enum JavelinError javelinCreate( struct JavelinState* state, const char* address, const javelin_u16 port, const javelin_u32 maxConnections, javelin_u32 (*randomGenerator)( void ) );
+enum JavelinError javelinCreateWithConfig( struct JavelinState* state, const char* address, const javelin_u16 port, const javelin_u32 maxConnections, javelin_u32 (*randomGenerator)( void ), const struct JavelinConfig* config );
 void javelinDestroy( struct JavelinState* state );
+enum JavelinError javelinCreateShards( struct JavelinState* shards, const javelin_u32 shardCount, const char* address, const javelin_u16 port, const javelin_u32 maxConnectionsPerShard, javelin_u32 (*randomGenerator)( void ), const struct JavelinConfig* config );
+void javelinDestroyShards( struct JavelinState* shards, const javelin_u32 shardCount );
+javelin_u64 javelinGetConnectionHandle( const struct JavelinConnection* connection );
+struct JavelinConnection* javelinFindConnection( struct JavelinState* shards, const javelin_u32 shardCount, const javelin_u64 handle );
+enum JavelinError javelinCreateSimulator( struct JavelinSimulator* simulator, const javelin_u32 maxEndpoints, const javelin_u64 seed, const struct JavelinLinkConditions* conditions );
+void javelinDestroySimulator( struct JavelinSimulator* simulator );
+enum JavelinError javelinCreateSimulated( struct JavelinState* state, struct JavelinSimulator* simulator, const char* address, const javelin_u16 port, const javelin_u32 maxConnections, javelin_u32 (*randomGenerator)( void ), const struct JavelinConfig* config );
+void javelinAdvanceSimulator( struct JavelinSimulator* simulator, const javelin_u32 ms );
 enum JavelinError javelinConnect( struct JavelinState* state, const char* address, const javelin_u16 port );
 void javelinDisconnect( struct JavelinState* state );
+void javelinUpdate( struct JavelinState* state );
+size_t javelinPollEvents( struct JavelinState* state, struct JavelinEvent* events, const size_t maxEvents );
 bool javelinProcess( struct JavelinState* state, struct JavelinEvent* outEvent );
+int javelinGetSocket( const struct JavelinState* state );
+javelin_u32 javelinGetNextTimeout( const struct JavelinState* state );
+void javelinGetStats( const struct JavelinState* state, struct JavelinStats* outStats );
+void javelinGetConnectionStats( const struct JavelinConnection* connection, struct JavelinStats* outStats );
+javelin_u32 javelinGetHistogramPercentile( const struct JavelinHistogram* histogram, const float fraction );
+bool javelinWait( struct JavelinState* state, const javelin_u32 maxWaitMs );
+enum JavelinError javelinStartThread( struct JavelinState* state, const javelin_u32 queueSize );
+void javelinStopThread( struct JavelinState* state );
 struct JavelinMessageBlock javelinCreateMessage( void );
 enum JavelinError javelinQueueMessage( struct JavelinConnection* connection, struct JavelinMessageBlock* block );
+enum JavelinError javelinQueueMessageConcurrent( struct JavelinState* shards, const javelin_u32 shardCount, const javelin_u64 handle, const struct JavelinMessageBlock* block );
+enum JavelinError javelinQueueUnreliableMessage( struct JavelinConnection* connection, struct JavelinMessageBlock* block );
+enum JavelinError javelinQueueSequencedMessage( struct JavelinConnection* connection, struct JavelinMessageBlock* block );
+enum JavelinError javelinBeginMessage( struct JavelinConnection* connection, const javelin_u32 channel, struct JavelinMessageBlock** outBlock );
+enum JavelinError javelinCommitMessage( struct JavelinConnection* connection, struct JavelinMessageBlock* block );
+enum JavelinError javelinQueueLargeMessage( struct JavelinConnection* connection, const javelin_u32 channel, const void* data, const size_t size );
+enum JavelinError javelinBroadcastMessage( struct JavelinState* state, struct JavelinMessageBlock* block );
+enum JavelinError javelinBroadcastMessageTo( struct JavelinState* state, struct JavelinConnection** connections, const size_t connectionCount, struct JavelinMessageBlock* block );
+enum JavelinError javelinFlush( struct JavelinConnection* connection );
 
 enum JavelinError javelinWriteCharArray( struct JavelinMessageBlock* block, const char* values, const size_t length );
 enum JavelinError javelinWriteU8( struct JavelinMessageBlock* block, const javelin_u8 value );
@@ -160,6 +542,7 @@ enum JavelinError javelinWriteS32( struct JavelinMessageBlock* block, const jave
 enum JavelinError javelinWriteU64( struct JavelinMessageBlock* block, const javelin_u64 value );
 enum JavelinError javelinWriteS64( struct JavelinMessageBlock* block, const javelin_s64 value );
 
+const javelin_u8* javelinGetMessageData( const struct JavelinMessageBlock* block );
 size_t javelinReadCharArray( struct JavelinMessageBlock* block, char* buffer, const size_t bufferSize );
 javelin_u8 javelinReadU8( struct JavelinMessageBlock* block );
 javelin_u16 javelinReadU16( struct JavelinMessageBlock* block );
@@ -169,6 +552,28 @@ javelin_s32 javelinReadS32( struct JavelinMessageBlock* block );
 javelin_u64 javelinReadU64( struct JavelinMessageBlock* block );
 javelin_s64 javelinReadS64( struct JavelinMessageBlock* block );
 
+struct JavelinBitWriter javelinBeginBits( struct JavelinMessageBlock* block );
+void javelinEndBits( struct JavelinBitWriter* writer );
+enum JavelinError javelinWriteBits( struct JavelinBitWriter* writer, const javelin_u32 value, const javelin_u32 bitCount );
+enum JavelinError javelinWriteBool( struct JavelinBitWriter* writer, const bool value );
+enum JavelinError javelinWriteVarU64( struct JavelinBitWriter* writer, const javelin_u64 value );
+enum JavelinError javelinWriteVarS64( struct JavelinBitWriter* writer, const javelin_s64 value );
+enum JavelinError javelinWriteRanged( struct JavelinBitWriter* writer, const javelin_s32 value, const javelin_s32 min, const javelin_s32 max );
+enum JavelinError javelinWriteFloat( struct JavelinBitWriter* writer, const float value );
+enum JavelinError javelinWriteQuantized( struct JavelinBitWriter* writer, const float value, const float min, const float max, const javelin_u32 bitCount );
+enum JavelinError javelinWriteQuantizedArray( struct JavelinBitWriter* writer, const float* values, const size_t count, const float min, const float max, const javelin_u32 bitCount );
+
+struct JavelinBitReader javelinBeginReadBits( struct JavelinMessageBlock* block );
+bool javelinEndReadBits( struct JavelinBitReader* reader );
+javelin_u32 javelinReadBits( struct JavelinBitReader* reader, const javelin_u32 bitCount );
+bool javelinReadBool( struct JavelinBitReader* reader );
+javelin_u64 javelinReadVarU64( struct JavelinBitReader* reader );
+javelin_s64 javelinReadVarS64( struct JavelinBitReader* reader );
+javelin_s32 javelinReadRanged( struct JavelinBitReader* reader, const javelin_s32 min, const javelin_s32 max );
+float javelinReadFloat( struct JavelinBitReader* reader );
+float javelinReadQuantized( struct JavelinBitReader* reader, const float min, const float max, const javelin_u32 bitCount );
+void javelinReadQuantizedArray( struct JavelinBitReader* reader, float* values, const size_t count, const float min, const float max, const javelin_u32 bitCount );
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,393 @@
+#define _POSIX_C_SOURCE 200809L
+#include "javelin.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <netinet/in.h>
+#endif
+
+// Load generator: one process runs a server and thousands of clients, each client sending messages at a fixed
+// rate, and reports what the server saw. By default the clients reach the server through the in-process simulator,
+// whose clock only moves on once the server's tick is done, so the clients' own work never skews the server's
+// numbers. With --udp they use real loopback sockets instead (mind the open file limit).
+//
+//   loadgen [-c clients] [-r messages per second per client] [-s message size] [-t tick ms] [-d seconds]
+//           [-l latency ms] [-p loss percent] [-f flush interval ms] [-b packet budget] [--udp] [--sweep]
+//
+// --sweep doubles the client count from 64 up to -c, stopping at the first count the server can't keep up with.
+// Each run ends with one line of JSON.
+
+#define LATENCY_BUCKETS 10000
+
+struct LoadOptions {
+	javelin_u32 clientCount;
+	javelin_u32 messageRate;
+	javelin_u32 messageSize;
+	javelin_u32 tickMs;
+	javelin_u32 seconds;
+	javelin_u32 latencyMs;
+	javelin_u32 lossPercent;
+	javelin_u32 flushInterval;	// config.flushInterval for the server and clients
+	javelin_u32 packetBudget;	// config.packetBudget for the server
+	bool useSockets;
+	bool sweep;
+};
+
+struct LoadClient {
+	struct JavelinState state;
+	bool isConnected;
+	javelin_u32 sendCredit;	// thousandths of a message owed
+};
+
+struct LoadRun {
+	const struct LoadOptions* options;
+	struct JavelinSimulator simulator;
+	struct JavelinState* server;
+	struct LoadClient* clients;
+	javelin_u32 clientCount;
+	javelin_u32 connectedCount;
+	double connectSeconds;
+	bool isMeasuring;
+	javelin_u64 messagesReceived;
+	javelin_u64 bytesReceived;
+	javelin_u64 sendFailures;
+	javelin_u64 latencyCounts[LATENCY_BUCKETS + 1];	// by milliseconds, the last one for anything longer
+	javelin_u32* tickTimes;	// microseconds the server spent on each measured tick
+	javelin_u32 tickCount;
+	javelin_u32 tickCapacity;
+};
+
+static javelin_u32 randomNumber( void )
+{
+	javelin_u32 v1 = rand();
+	javelin_u32 v2 = rand();
+	return (v1 << 16) ^ v2 ^ 1;
+}
+
+static javelin_u64 getMicroseconds( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (javelin_u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Milliseconds on the clock the server itself runs on
+static javelin_u64 getRunTime( const struct LoadRun* run )
+{
+	return run->options->useSockets ? getMicroseconds() / 1000 : run->simulator.time;
+}
+
+static int compareU32( const void* a, const void* b )
+{
+	const javelin_u32 x = *(const javelin_u32*)a;
+	const javelin_u32 y = *(const javelin_u32*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static javelin_u32 latencyPercentile( const struct LoadRun* run, const double fraction )
+{
+	const javelin_u64 target = (javelin_u64)(run->messagesReceived * fraction);
+	javelin_u64 seen = 0;
+	for ( javelin_u32 i = 0; i <= LATENCY_BUCKETS; i++ ) {
+		seen += run->latencyCounts[i];
+		if ( seen > target ) {
+			return i;
+		}
+	}
+	return LATENCY_BUCKETS;
+}
+
+static void serverTick( struct LoadRun* run )
+{
+	const javelin_u64 now = getRunTime( run );
+	struct JavelinEvent event;
+	while ( javelinProcess( run->server, &event ) ) {
+		if ( event.type != JAVELIN_EVENT_DATA || !run->isMeasuring ) {
+			continue;
+		}
+		const javelin_u64 sendTime = javelinReadU64( event.message );
+		const javelin_u64 latency = now > sendTime ? now - sendTime : 0;
+		run->latencyCounts[latency < LATENCY_BUCKETS ? latency : LATENCY_BUCKETS]++;
+		run->messagesReceived++;
+		run->bytesReceived += event.message->size;
+	}
+}
+
+static void clientTick( struct LoadRun* run, const bool canSend )
+{
+	const struct LoadOptions* options = run->options;
+	const javelin_u64 now = getRunTime( run );
+	for ( javelin_u32 i = 0; i < run->clientCount; i++ ) {
+		struct LoadClient* client = &run->clients[i];
+		// Queued before processing, so the messages go out this tick
+		if ( canSend && client->isConnected ) {
+			client->sendCredit += options->messageRate * options->tickMs;
+			while ( client->sendCredit >= 1000 ) {
+				client->sendCredit -= 1000;
+				struct JavelinMessageBlock block = javelinCreateMessage();
+				javelinWriteU64( &block, now );
+				block.size = options->messageSize;
+				if ( javelinQueueMessage( &client->state.connectionSlots[0], &block ) != JAVELIN_ERROR_OK ) {
+					run->sendFailures++;
+				}
+			}
+		}
+		struct JavelinEvent event;
+		while ( javelinProcess( &client->state, &event ) ) {
+			if ( event.type == JAVELIN_EVENT_CONNECT ) {
+				client->isConnected = true;
+				// Spread the clients' sends across ticks
+				client->sendCredit = (i * 997) % 1000;
+				run->connectedCount++;
+			}
+			else if ( event.type == JAVELIN_EVENT_DISCONNECT && client->isConnected ) {
+				client->isConnected = false;
+				run->connectedCount--;
+			}
+		}
+	}
+}
+
+// Runs one tick of the server, timed, then one of every client, then waits for the next tick
+static void runTick( struct LoadRun* run, const bool canSend )
+{
+	const struct LoadOptions* options = run->options;
+	const javelin_u64 start = getMicroseconds();
+	serverTick( run );
+	const javelin_u64 serverTime = getMicroseconds() - start;
+	if ( run->isMeasuring ) {
+		if ( run->tickCount == run->tickCapacity ) {
+			run->tickCapacity = run->tickCapacity > 0 ? run->tickCapacity * 2 : 1024;
+			run->tickTimes = (javelin_u32*)realloc( run->tickTimes, run->tickCapacity * sizeof (javelin_u32) );
+		}
+		run->tickTimes[run->tickCount++] = (javelin_u32)serverTime;
+	}
+	clientTick( run, canSend );
+
+	if ( options->useSockets ) {
+		const javelin_u64 elapsed = getMicroseconds() - start;
+		if ( elapsed < options->tickMs * 1000ull ) {
+			struct timespec ts = { 0, (long)(options->tickMs * 1000ull - elapsed) * 1000 };
+			nanosleep( &ts, NULL );
+		}
+	}
+	else {
+		// A server that overruns its tick holds up the next one, just as it would in real time
+		const javelin_u64 serverMs = (serverTime + 999) / 1000;
+		javelinAdvanceSimulator( &run->simulator, serverMs > options->tickMs ? (javelin_u32)serverMs : options->tickMs );
+	}
+}
+
+static bool createRun( struct LoadRun* run, const struct LoadOptions* options, const javelin_u32 clientCount )
+{
+	memset( run, 0, sizeof (struct LoadRun) );
+	run->options = options;
+	run->server = (struct JavelinState*)calloc( 1, sizeof (struct JavelinState) );
+	run->clients = (struct LoadClient*)calloc( clientCount, sizeof (struct LoadClient) );
+	if ( run->server == NULL || run->clients == NULL ) {
+		printf( "Out of memory for %u clients\n", clientCount );
+		return false;
+	}
+
+	struct JavelinConfig config = javelinCreateConfig();
+	config.flushInterval = options->flushInterval;
+	config.packetBudget = options->packetBudget;
+	javelin_u16 port = 1000;
+	if ( options->useSockets ) {
+		if ( javelinCreateWithConfig( run->server, "127.0.0.1", 0, clientCount, randomNumber, &config ) != JAVELIN_ERROR_OK ) {
+			printf( "Error initializing server\n" );
+			return false;
+		}
+		struct sockaddr_storage serverAddress;
+		socklen_t addressLength = sizeof (serverAddress);
+		getsockname( javelinGetSocket( run->server ), (struct sockaddr*)&serverAddress, &addressLength );
+		port = ntohs( ((struct sockaddr_in*)&serverAddress)->sin_port );
+	}
+	else {
+		const struct JavelinLinkConditions conditions = { .latencyMs = options->latencyMs, .lossRate = options->lossPercent / 100.0f };
+		if ( javelinCreateSimulator( &run->simulator, clientCount + 1, 1, &conditions ) != JAVELIN_ERROR_OK
+			|| javelinCreateSimulated( run->server, &run->simulator, NULL, port, clientCount, randomNumber, &config ) != JAVELIN_ERROR_OK ) {
+			printf( "Error initializing simulated server\n" );
+			return false;
+		}
+	}
+
+	for ( javelin_u32 i = 0; i < clientCount; i++ ) {
+		struct JavelinState* state = &run->clients[i].state;
+		const enum JavelinError result = options->useSockets
+			? javelinCreateWithConfig( state, "127.0.0.1", 0, 1, randomNumber, &config )
+			: javelinCreateSimulated( state, &run->simulator, NULL, 0, 1, randomNumber, &config );
+		if ( result != JAVELIN_ERROR_OK ) {
+			printf( "Error initializing client %u (error %d)\n", i, result );
+			return false;
+		}
+		run->clientCount++;
+	}
+
+	// Keep no more handshakes in progress than the server has pending connection slots for
+	const javelin_u32 wave = JAVELIN_MAX_PENDING_CONNECTIONS;
+	const javelin_u64 connectStart = getRunTime( run );
+	javelin_u32 started = 0;
+	for ( javelin_u32 tick = 0; run->connectedCount < clientCount && tick < 100000; tick++ ) {
+		while ( started < clientCount && started - run->connectedCount < wave ) {
+			if ( javelinConnect( &run->clients[started].state, "127.0.0.1", port ) != JAVELIN_ERROR_OK ) {
+				printf( "Error connecting client %u\n", started );
+				return false;
+			}
+			started++;
+		}
+		runTick( run, false );
+	}
+	run->connectSeconds = (getRunTime( run ) - connectStart) / 1000.0;
+	return run->connectedCount == clientCount;
+}
+
+static void destroyRun( struct LoadRun* run )
+{
+	for ( javelin_u32 i = 0; i < run->clientCount; i++ ) {
+		javelinDestroy( &run->clients[i].state );
+	}
+	if ( run->server != NULL ) {
+		javelinDestroy( run->server );
+	}
+	if ( !run->options->useSockets ) {
+		javelinDestroySimulator( &run->simulator );
+	}
+	free( run->server );
+	free( run->clients );
+	free( run->tickTimes );
+}
+
+// Returns true if the server kept its 99th percentile tick within the tick interval
+static bool runLoad( const struct LoadOptions* options, const javelin_u32 clientCount )
+{
+	struct LoadRun* run = (struct LoadRun*)malloc( sizeof (struct LoadRun) );
+	if ( run == NULL ) {
+		return false;
+	}
+	if ( !createRun( run, options, clientCount ) ) {
+		printf( "Only %u of %u clients connected\n", run->connectedCount, clientCount );
+		destroyRun( run );
+		free( run );
+		return false;
+	}
+
+	const javelin_u32 ticksPerSecond = 1000 / options->tickMs;
+	for ( javelin_u32 tick = 0; tick < ticksPerSecond; tick++ ) {
+		runTick( run, true );
+	}
+	run->isMeasuring = true;
+	const javelin_u64 measureStart = getRunTime( run );
+	const javelin_u64 packetsStart = run->server->packetsSent + run->server->packetsReceived;
+	while ( getRunTime( run ) - measureStart < options->seconds * 1000ull ) {
+		runTick( run, true );
+	}
+	const double seconds = (getRunTime( run ) - measureStart) / 1000.0;
+	const double packetsPerSecond = (run->server->packetsSent + run->server->packetsReceived - packetsStart) / seconds;
+
+	qsort( run->tickTimes, run->tickCount, sizeof (javelin_u32), compareU32 );
+	javelin_u32 ticksOver = 0;
+	for ( javelin_u32 i = 0; i < run->tickCount; i++ ) {
+		ticksOver += run->tickTimes[i] > options->tickMs * 1000;
+	}
+	const double tickP50 = run->tickCount > 0 ? run->tickTimes[run->tickCount / 2] / 1000.0 : 0;
+	const double tickP99 = run->tickCount > 0 ? run->tickTimes[run->tickCount * 99 / 100] / 1000.0 : 0;
+	const double tickMax = run->tickCount > 0 ? run->tickTimes[run->tickCount - 1] / 1000.0 : 0;
+	const bool isKeepingUp = tickP99 <= options->tickMs;
+
+	printf( "{\"transport\":\"%s\",\"clients\":%u,\"connected\":%u,\"connects_per_sec\":%.0f,\"message_rate\":%u,\"message_size\":%u,"
+		"\"messages_per_sec\":%.0f,\"mb_per_sec\":%.3f,\"send_failures\":%llu,\"server_packets_per_sec\":%.0f,\"flush_ms\":%u,\"packet_budget\":%u,\"latency_p50_ms\":%u,\"latency_p99_ms\":%u,"
+		"\"tick_ms\":%u,\"tick_p50_ms\":%.3f,\"tick_p99_ms\":%.3f,\"tick_max_ms\":%.3f,\"ticks\":%u,\"ticks_over\":%u,\"keeping_up\":%s}\n",
+		options->useSockets ? "udp" : "simulated", clientCount, run->connectedCount, run->connectSeconds > 0 ? clientCount / run->connectSeconds : 0.0,
+		options->messageRate, options->messageSize,
+		run->messagesReceived / seconds, run->bytesReceived / seconds / 1e6, (unsigned long long)run->sendFailures,
+		packetsPerSecond, options->flushInterval, options->packetBudget,
+		latencyPercentile( run, 0.5 ), latencyPercentile( run, 0.99 ),
+		options->tickMs, tickP50, tickP99, tickMax, run->tickCount, ticksOver, isKeepingUp ? "true" : "false" );
+	fflush( stdout );
+
+	destroyRun( run );
+	free( run );
+	return isKeepingUp;
+}
+
+int main( int argc, char** argv )
+{
+	struct LoadOptions options = {
+		.clientCount = 1024,
+		.messageRate = 20,
+		.messageSize = 32,
+		.tickMs = 16,
+		.seconds = 10,
+		.latencyMs = 20,
+		.lossPercent = 0,
+		.flushInterval = 0,
+		.packetBudget = 0,
+		.useSockets = false,
+		.sweep = false,
+	};
+	for ( int i = 1; i < argc; i++ ) {
+		const bool hasValue = i + 1 < argc;
+		if ( strcmp( argv[i], "--udp" ) == 0 ) {
+			options.useSockets = true;
+		}
+		else if ( strcmp( argv[i], "--sweep" ) == 0 ) {
+			options.sweep = true;
+		}
+		else if ( hasValue && strcmp( argv[i], "-c" ) == 0 ) {
+			options.clientCount = atoi( argv[++i] );
+		}
+		else if ( hasValue && strcmp( argv[i], "-r" ) == 0 ) {
+			options.messageRate = atoi( argv[++i] );
+		}
+		else if ( hasValue && strcmp( argv[i], "-s" ) == 0 ) {
+			options.messageSize = atoi( argv[++i] );
+		}
+		else if ( hasValue && strcmp( argv[i], "-t" ) == 0 ) {
+			options.tickMs = atoi( argv[++i] );
+		}
+		else if ( hasValue && strcmp( argv[i], "-d" ) == 0 ) {
+			options.seconds = atoi( argv[++i] );
+		}
+		else if ( hasValue && strcmp( argv[i], "-l" ) == 0 ) {
+			options.latencyMs = atoi( argv[++i] );
+		}
+		else if ( hasValue && strcmp( argv[i], "-p" ) == 0 ) {
+			options.lossPercent = atoi( argv[++i] );
+		}
+		else if ( hasValue && strcmp( argv[i], "-f" ) == 0 ) {
+			options.flushInterval = atoi( argv[++i] );
+		}
+		else if ( hasValue && strcmp( argv[i], "-b" ) == 0 ) {
+			options.packetBudget = atoi( argv[++i] );
+		}
+		else {
+			printf( "Usage: loadgen [-c clients] [-r rate] [-s size] [-t tick ms] [-d seconds] [-l latency ms] [-p loss percent] [-f flush interval ms] [-b packet budget] [--udp] [--sweep]\n" );
+			return 1;
+		}
+	}
+	// Each message carries the time it was sent
+	if ( options.messageSize < 8 ) {
+		options.messageSize = 8;
+	}
+	if ( options.messageSize > JAVELIN_MAX_MESSAGE_SIZE ) {
+		options.messageSize = JAVELIN_MAX_MESSAGE_SIZE;
+	}
+	if ( options.tickMs == 0 || options.tickMs > 1000 || options.clientCount == 0 ) {
+		printf( "Invalid tick or client count\n" );
+		return 1;
+	}
+	srand( 1 );
+
+	if ( !options.sweep ) {
+		return runLoad( &options, options.clientCount ) ? 0 : 1;
+	}
+	for ( javelin_u32 clientCount = options.clientCount < 64 ? options.clientCount : 64; clientCount <= options.clientCount; clientCount *= 2 ) {
+		if ( !runLoad( &options, clientCount ) ) {
+			break;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,215 @@
+#include "javelin.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Regression checks over the in-process simulator. A client sends reliable and large messages to a server across
+// a lossy simulated link, and the server checks that each channel delivers every message once, in order and intact.
+// Every run is seeded, so a failure repeats exactly. Build with a sanitizer to catch memory errors as well:
+//
+//   simtest [first seed] [seed count]
+//
+// Runs every scenario with each seed (1 to 4 by default), printing a line per run, and exits with 1 if any fail.
+
+struct SimScenario {
+	const char* name;
+	struct JavelinLinkConditions conditions;
+	javelin_u32 channelCount;
+	javelin_u32 messageCount;	// reliable messages, spread over the channels
+	javelin_u32 largeCount;	// large messages, spread over the channels between the reliable ones
+	javelin_u32 largeSize;
+	javelin_u32 initialMessages;	// config.initialMessages, small so the rings grow while messages are delivered
+	javelin_u32 pollSize;	// events per javelinPollEvents call on the server
+	javelin_u32 tickMs;
+};
+
+static const struct SimScenario scenarios[] = {
+	// Fragments delivered early in a poll, then a ring grown later in the same poll
+	{ "fragments_under_loss", { 30, 20, 0.1f, 0.02f, 0.05f }, 4, 1000, 80, 20000, 2, 1024, 40 },
+	// Every channel in use, heavy loss, and one event per poll as with javelinProcess
+	{ "channels_heavy_loss", { 50, 30, 0.3f, 0.05f, 0.1f }, JAVELIN_MAX_CHANNELS, 4000, 16, 5000, 4, 1, 5 },
+	// Large messages far bigger than a ring's worth of fragments, so sending waits on acks
+	{ "large_messages", { 20, 10, 0.05f, 0.01f, 0.05f }, 2, 100, 20, 200000, 16, 64, 16 },
+};
+
+static javelin_u64 randomState;
+
+static javelin_u32 randomNumber( void )
+{
+	// xorshift64, so the states' salts repeat with the seed
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 7;
+	randomState ^= randomState << 17;
+	return (javelin_u32)(randomState >> 32) | 1;
+}
+
+static javelin_u8 largeByte( const javelin_u32 order, const javelin_u32 index )
+{
+	return (javelin_u8)(index * 31 + order * 7);
+}
+
+// Sends the next message on a channel, numbered by its order on that channel. Returns false if there is no room yet.
+static bool sendNext( struct JavelinConnection* connection, const javelin_u32 channel, const javelin_u32 order, const bool isLarge, const javelin_u32 largeSize, javelin_u8* largeData )
+{
+	if ( isLarge ) {
+		memcpy( largeData, &order, sizeof (order) );
+		for ( javelin_u32 i = sizeof (order); i < largeSize; i++ ) {
+			largeData[i] = largeByte( order, i );
+		}
+		return javelinQueueLargeMessage( connection, channel, largeData, largeSize ) == JAVELIN_ERROR_OK;
+	}
+	struct JavelinMessageBlock block = javelinCreateMessage();
+	block.channel = channel;
+	javelinWriteU32( &block, order );
+	javelinWriteU32( &block, ~order );
+	return javelinQueueMessage( connection, &block ) == JAVELIN_ERROR_OK;
+}
+
+// Checks a message the server received against the next one expected on its channel
+static bool checkMessage( const struct JavelinMessageBlock* message, javelin_u32* nextOrder, const javelin_u32 largeSize )
+{
+	const javelin_u32 channel = message->channel;
+	const javelin_u8* data = javelinGetMessageData( message );
+	javelin_u32 order;
+	memcpy( &order, data, sizeof (order) );
+	if ( order != nextOrder[channel] ) {
+		printf( "  channel %u delivered message %u, expected %u\n", channel, order, nextOrder[channel] );
+		return false;
+	}
+	nextOrder[channel]++;
+	if ( message->size == largeSize ) {
+		for ( javelin_u32 i = sizeof (order); i < largeSize; i++ ) {
+			if ( data[i] != largeByte( order, i ) ) {
+				printf( "  channel %u large message %u differs at byte %u\n", channel, order, i );
+				return false;
+			}
+		}
+		return true;
+	}
+	javelin_u32 check;
+	memcpy( &check, data + sizeof (order), sizeof (check) );
+	if ( message->size != 2 * sizeof (javelin_u32) || check != ~order ) {
+		printf( "  channel %u message %u is corrupt\n", channel, order );
+		return false;
+	}
+	return true;
+}
+
+static bool runScenario( const struct SimScenario* scenario, const javelin_u64 seed )
+{
+	randomState = seed != 0 ? seed : 1;
+	struct JavelinSimulator simulator;
+	if ( javelinCreateSimulator( &simulator, 2, seed, &scenario->conditions ) != JAVELIN_ERROR_OK ) {
+		printf( "  error creating simulator\n" );
+		return false;
+	}
+	struct JavelinConfig config = javelinCreateConfig();
+	config.channelCount = scenario->channelCount;
+	config.initialMessages = scenario->initialMessages;
+	struct JavelinState* server = (struct JavelinState*)malloc( sizeof (struct JavelinState) );
+	struct JavelinState* client = (struct JavelinState*)malloc( sizeof (struct JavelinState) );
+	struct JavelinEvent* events = (struct JavelinEvent*)malloc( sizeof (struct JavelinEvent) * scenario->pollSize );
+	javelin_u8* largeData = (javelin_u8*)malloc( scenario->largeSize );
+	if ( server == NULL || client == NULL || events == NULL || largeData == NULL
+		|| javelinCreateSimulated( server, &simulator, "10.0.0.1", 9000, 1, randomNumber, &config ) != JAVELIN_ERROR_OK ) {
+		printf( "  error creating server\n" );
+		javelinDestroySimulator( &simulator );
+		free( server );
+		free( client );
+		free( events );
+		free( largeData );
+		return false;
+	}
+	if ( javelinCreateSimulated( client, &simulator, "10.0.0.2", 0, 1, randomNumber, &config ) != JAVELIN_ERROR_OK || javelinConnect( client, "10.0.0.1", 9000 ) != JAVELIN_ERROR_OK ) {
+		printf( "  error creating client\n" );
+		javelinDestroy( server );
+		javelinDestroySimulator( &simulator );
+		free( server );
+		free( client );
+		free( events );
+		free( largeData );
+		return false;
+	}
+
+	const javelin_u32 totalCount = scenario->messageCount + scenario->largeCount;
+	const javelin_u32 largeEvery = scenario->largeCount > 0 ? totalCount / scenario->largeCount : 0;
+	javelin_u32 sendOrder[JAVELIN_MAX_CHANNELS] = { 0 };
+	javelin_u32 nextOrder[JAVELIN_MAX_CHANNELS] = { 0 };
+	javelin_u32 sentCount = 0;
+	javelin_u32 receivedCount = 0;
+	bool isConnected = false;
+	bool ok = true;
+	const javelin_u64 startTime = simulator.time;
+	while ( ok && receivedCount < totalCount ) {
+		if ( simulator.time - startTime > 600000 ) {
+			printf( "  timed out with %u of %u messages delivered\n", receivedCount, totalCount );
+			ok = false;
+			break;
+		}
+
+		// The client queues as much as its rings take each tick, so the link stays saturated
+		struct JavelinEvent event;
+		while ( javelinProcess( client, &event ) ) {
+			if ( event.type == JAVELIN_EVENT_CONNECT ) {
+				isConnected = true;
+			}
+			else if ( event.type == JAVELIN_EVENT_DISCONNECT ) {
+				printf( "  client disconnected\n" );
+				ok = false;
+			}
+		}
+		while ( isConnected && sentCount < totalCount ) {
+			const javelin_u32 channel = sentCount % scenario->channelCount;
+			const bool isLarge = largeEvery > 0 && sentCount % largeEvery == largeEvery - 1;
+			if ( !sendNext( &client->connectionSlots[0], channel, sendOrder[channel], isLarge, scenario->largeSize, largeData ) ) {
+				break;
+			}
+			sendOrder[channel]++;
+			sentCount++;
+		}
+		javelinUpdate( client );
+
+		javelinUpdate( server );
+		size_t eventCount;
+		while ( ok && (eventCount = javelinPollEvents( server, events, scenario->pollSize )) > 0 ) {
+			// Check the whole batch only once it is complete, since every event has to stay valid until the next poll
+			for ( size_t i = 0; i < eventCount && ok; i++ ) {
+				if ( events[i].type == JAVELIN_EVENT_DATA ) {
+					ok = checkMessage( events[i].message, nextOrder, scenario->largeSize );
+					receivedCount++;
+				}
+				else if ( events[i].type == JAVELIN_EVENT_DISCONNECT ) {
+					printf( "  server lost the client\n" );
+					ok = false;
+				}
+			}
+		}
+		javelinAdvanceSimulator( &simulator, scenario->tickMs );
+	}
+
+	printf( "%s seed %llu: %s, %u messages in %llu ms, %llu packets sent, %llu lost\n", scenario->name, (unsigned long long)seed,
+		ok ? "ok" : "FAILED", receivedCount, (unsigned long long)(simulator.time - startTime),
+		(unsigned long long)simulator.packetsSent, (unsigned long long)simulator.packetsLost );
+
+	javelinDestroy( client );
+	javelinDestroy( server );
+	javelinDestroySimulator( &simulator );
+	free( server );
+	free( client );
+	free( events );
+	free( largeData );
+	return ok;
+}
+
+int main( int argc, char** argv )
+{
+	const javelin_u64 firstSeed = argc > 1 ? strtoull( argv[1], NULL, 10 ) : 1;
+	const javelin_u64 seedCount = argc > 2 ? strtoull( argv[2], NULL, 10 ) : 4;
+	bool ok = true;
+	for ( size_t i = 0; i < sizeof (scenarios) / sizeof (scenarios[0]); i++ ) {
+		for ( javelin_u64 seed = firstSeed; seed < firstSeed + seedCount; seed++ ) {
+			ok = runScenario( &scenarios[i], seed ) && ok;
+		}
+	}
+	return ok ? 0 : 1;
+}